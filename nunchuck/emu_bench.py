@@ -0,0 +1,301 @@
+import bisect
+import fcntl
+import glob
+import os
+import select
+import struct
+import time
+
+# Drives nunchuck.ko against the emulated controller of nunchuck_emu.ko:
+# scripts a ramp on the accelerometer X axis with a different joystick
+# position and button state in every frame, checks every decoded ABS_X
+# event against the frame that produced it and the joystick and button
+# events of the same sample against the driver's filter, and reports the
+# achieved sample rate and the frame-read to event-read latency. Run as
+# root from this directory after building both modules.
+
+module_name = 'nunchuck'
+emu_name = 'nunchuck_emu'
+emu_debugfs = '/sys/kernel/debug/nunchuck_emu'
+sleep_ms = 5
+duration = 5.0
+
+EV_SYN = 0x00
+EV_KEY = 0x01
+EV_REL = 0x02
+EV_ABS = 0x03
+SYN_REPORT = 0
+REL_X = 0x00
+REL_Y = 0x01
+ABS_X = 0x00
+BTN_LEFT = 0x110
+BTN_RIGHT = 0x111
+CLOCK_MONOTONIC = 1
+EVIOCSCLOCKID = 0x400445a0
+KEY_BYTES = 96
+EVIOCGKEY = 0x80000000 | KEY_BYTES << 16 | ord('E') << 8 | 0x18
+event_format = 'llHHi'
+event_size = struct.calcsize(event_format)
+
+# both devices are synced by the same run of the work, well within this
+match_ns = sleep_ms * 1000000 // 2
+
+
+# ABS_X is registered with fuzz 4 and the input core smooths or drops
+# changes below twice that, so the ramp steps by at least 9: byte 2 moves
+# by 3 (12 counts) while the low bits in byte 5 cycle through i & 3.
+ramp_step = 3
+nr_frames = 256 // ramp_step
+
+
+def joystick(i):
+    # x sweeps -42..42 with the ramp, y visits the same values shuffled
+    return i - 42, (i * 5) % nr_frames - 42
+
+
+def buttons(i):
+    # C in bit 1, Z in bit 0, pressed when set
+    return (i >> 2) & 3
+
+
+def frame(i):
+    dx, dy = joystick(i)
+    return [0x80 + dx, 0x80 - dy, i * ramp_step, 0x80, 0x80,
+            (~buttons(i) & 3) | (i & 3) << 2]
+
+
+def frame_index(ax):
+    return ax // (ramp_step << 2)
+
+
+def expected_ax(i):
+    return (i * ramp_step) << 2 | (i & 3)
+
+
+def cdiv(a, b):
+    q = abs(a) // abs(b)
+    return -q if (a < 0) != (b < 0) else q
+
+
+def curve(gains, v):
+    pos = min(abs(v), 127) * (len(gains) - 1)
+    idx, frac = pos >> 7, pos & 127
+    gain = gains[idx] + ((gains[idx + 1] - gains[idx]) * frac >> 7)
+    return cdiv(v * gain, 256)
+
+
+def expected_rel(i, params):
+    # nunchuck_filter() with smoothing 0, which the harness sets
+    dx, dy = joystick(i)
+    rel = {}
+    for code, v in ((REL_X, 0x80 + dx - params['center_x']),
+                    (REL_Y, params['center_y'] - (0x80 - dy))):
+        v = cdiv(curve(params['accel_curve'], v), params['scale_factor'])
+        if abs(v) >= params['threshold']:
+            rel[code] = v
+    return {code: v for code, v in rel.items() if v}
+
+
+def expected_keys(i):
+    return {BTN_LEFT: buttons(i) >> 1 & 1, BTN_RIGHT: buttons(i) & 1}
+
+
+def find_event_node(name):
+    for path in glob.glob('/sys/class/input/event*/device/name'):
+        with open(path) as f:
+            if f.read().strip() == name:
+                return '/dev/input/' + path.split('/')[4]
+    return None
+
+
+def read_served():
+    served = []
+    with open(emu_debugfs + '/served') as f:
+        for line in f:
+            seq, ts_ns, data = line.split()
+            served.append((int(ts_ns), bytes.fromhex(data)[2] // ramp_step))
+    return served
+
+
+def read_params():
+    params = {}
+    for path in glob.glob('/sys/bus/i2c/drivers/nunchuck/*/'):
+        for name in ('center_x', 'center_y', 'scale_factor', 'threshold'):
+            with open(path + name) as f:
+                params[name] = int(f.read())
+        with open(path + 'accel_curve') as f:
+            params['accel_curve'] = [int(g) for g in f.read().split()]
+    return params
+
+
+def open_node(node):
+    fd = os.open(node, os.O_RDONLY | os.O_NONBLOCK)
+    fcntl.ioctl(fd, EVIOCSCLOCKID, struct.pack('i', CLOCK_MONOTONIC))
+    return fd
+
+
+def key_state(fd):
+    # also drops queued key events, so state and queue agree
+    bits = fcntl.ioctl(fd, EVIOCGKEY, bytes(KEY_BYTES))
+    return {code: bits[code >> 3] >> (code & 7) & 1
+            for code in (BTN_LEFT, BTN_RIGHT)}
+
+
+def collect(nodes):
+    """
+    Read the event nodes for duration seconds and return, per node, its
+    packets as (event time, read time, events) in arrival order.
+    """
+    fds = [open_node(node) for node in nodes]
+    keys = key_state(fds[0])
+    packets = {fd: [] for fd in fds}
+    pending = {fd: [] for fd in fds}
+    start = time.monotonic_ns()
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        ready, _, _ = select.select(fds, [], [], 0.1)
+        for fd in ready:
+            try:
+                data = os.read(fd, event_size * 64)
+            except BlockingIOError:
+                continue
+            now = time.monotonic_ns()
+            for off in range(0, len(data), event_size):
+                sec, usec, type, code, value = struct.unpack_from(
+                    event_format, data, off)
+                if type == EV_SYN and code == SYN_REPORT:
+                    packets[fd].append((sec * 1000000000 + usec * 1000, now,
+                                        pending[fd]))
+                    pending[fd] = []
+                elif type != EV_SYN:
+                    pending[fd].append((type, code, value))
+    window = (start, time.monotonic_ns())
+    for fd in fds:
+        os.close(fd)
+    return [packets[fd] for fd in fds], keys, window
+
+
+def check_accel(packets, served):
+    """
+    Return the frames seen on the accelerometer as (event time, index) and
+    the mismatches and latencies of their ABS_X events.
+    """
+    frames = []
+    mismatches = 0
+    latencies = []
+    for ts, now, events in packets:
+        for type, code, value in events:
+            if type != EV_ABS or code != ABS_X:
+                continue
+            i = frame_index(value)
+            if value != expected_ax(i):
+                mismatches += 1
+                continue
+            # the latest read of frame i before the event reached us
+            reads = [t for t, b in served if b == i and t <= now]
+            if not reads:
+                mismatches += 1
+                continue
+            latencies.append(now - reads[-1])
+            frames.append((ts, i))
+    return frames, mismatches, latencies
+
+
+def check_joystick(frames, packets, keys, params):
+    """
+    Pair each frame with the joystick packet synced by the same sample and
+    compare its REL_X/REL_Y and the button state against the frame. A
+    sample without joystick motion or button change has no packet. The
+    first and last frames may have been seen on one node only, so they
+    are not checked, but their key events still count.
+    """
+    times = [packet[0] for packet in packets]
+    mismatches = 0
+    checked = 0
+    done = 0
+
+    def apply(packet):
+        rel = {}
+        for type, code, value in packet[2]:
+            if type == EV_KEY:
+                keys[code] = value
+            elif type == EV_REL:
+                rel[code] = value
+        return rel
+
+    for n, (ts, i) in enumerate(frames):
+        edge = n == 0 or n == len(frames) - 1
+        lo = bisect.bisect_left(times, ts - match_ns)
+        hi = bisect.bisect_right(times, ts + match_ns)
+        for packet in packets[done:lo]:
+            apply(packet)
+            # a packet that belongs to no frame
+            if n > 0:
+                mismatches += 1
+        rel = {}
+        for packet in packets[max(lo, done):hi]:
+            rel.update(apply(packet))
+        done = max(done, hi)
+
+        if edge:
+            continue
+        if rel != expected_rel(i, params) or keys != expected_keys(i):
+            mismatches += 1
+        checked += 1
+    return checked, mismatches
+
+
+def report(accel, joy, keys, window, served, params):
+    frames, mismatches, latencies = check_accel(accel, served)
+    checked, joy_mismatches = check_joystick(frames, joy, keys, params)
+
+    # only frames read while collecting, at the configured period
+    during = [ts for ts, _ in served if window[0] <= ts <= window[1]]
+    span = (during[-1] - during[0]) / 1e9 if len(during) > 1 else 0
+    print("%d frames served, %.1f Hz (period %d ms)" %
+          (len(during), (len(during) - 1) / span if span else 0, sleep_ms))
+    print("%d ABS_X events, %d mismatched" % (len(frames) + mismatches,
+                                              mismatches))
+    print("%d samples checked for joystick and buttons, %d mismatched" %
+          (checked, joy_mismatches))
+    if latencies:
+        latencies.sort()
+        print("latency us: min %.1f median %.1f p99 %.1f max %.1f" %
+              (latencies[0] / 1e3,
+               latencies[len(latencies) // 2] / 1e3,
+               latencies[len(latencies) * 99 // 100] / 1e3,
+               latencies[-1] / 1e3))
+    return (mismatches == 0 and joy_mismatches == 0 and len(frames) > 0 and
+            checked > 0)
+
+
+if __name__ == '__main__':
+    print("loading %s and %s modules" % (module_name, emu_name))
+    os.system('insmod %s.ko' % module_name)
+    os.system('insmod %s.ko' % emu_name)
+    ok = False
+    try:
+        # the script is replaced by each write, so hand it over in one
+        script = ''.join(' '.join('%02x' % b for b in frame(i)) + '\n'
+                         for i in range(nr_frames))
+        with open(emu_debugfs + '/frames', 'w') as f:
+            f.write(script)
+        for path in glob.glob('/sys/bus/i2c/drivers/nunchuck/*/'):
+            for name, value in (('sleep_ms', sleep_ms), ('smoothing', 0)):
+                with open(path + name, 'w') as f:
+                    f.write(str(value))
+
+        joy_node = find_event_node(module_name)
+        accel_node = find_event_node(module_name + ' accelerometer')
+        if joy_node is None or accel_node is None:
+            print("no %s input devices" % module_name)
+        else:
+            (joy, accel), keys, window = collect([joy_node, accel_node])
+            ok = report(accel, joy, keys, window, read_served(),
+                        read_params())
+    finally:
+        print("removing %s and %s modules" % (module_name, emu_name))
+        os.system('rmmod ' + emu_name)
+        os.system('rmmod ' + module_name)
+    print("PASS" if ok else "FAIL")
+    exit(0 if ok else 1)
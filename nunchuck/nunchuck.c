@@ -2,24 +2,70 @@
 #include <linux/module.h>
 #include <linux/i2c.h>
 #include <linux/delay.h>
-#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <linux/input.h>
 #include <linux/fs.h>
-#include <linux/mutex.h>
+#include <linux/atomic.h>
 #include <linux/sysfs.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#define NUNCHUCK_IIO
+#endif
+
+#include "nunchuck.h"
+
+#define CREATE_TRACE_POINTS
+#include "nunchuck_trace.h"
 
 #define DRIVER_NAME "nunchuck"
 #define THREAD_SLEEP_MS 50
 #define JOYSTICK_SCALE_FACTOR 3
 #define JOYSTICK_IGNORE_THREASHOLD 5
+/* time the controller needs between a conversion request and the read */
+#define NUNCHUCK_CONVERSION_US 1000
+#define IDLE_TIMEOUT_MS 5000
+#define IDLE_SLEEP_MS 200
+#define ACTIVITY_THRESHOLD 8
+#define NUNCHUCK_ACCEL_MAX 1023
+#define NUNCHUCK_ACCEL_FUZZ 4
+#define JOYSTICK_CENTER 128
+/* gains (Q8, 256 = 1.0) at evenly spaced joystick deflections 0..127 */
+#define NUNCHUCK_CURVE_POINTS 8
+/* keeps the filter's fixed-point products well inside an int */
+#define NUNCHUCK_GAIN_MAX (16 * 256)
+/* consecutive failures between two attempts to re-initialise the controller */
+#define NUNCHUCK_REINIT_ERRORS 4
+/* upper bound of the period while backing off after failures */
+#define NUNCHUCK_BACKOFF_MAX_MS 2000
+/* upper bound of frozen_repeats, the stuck-frame check (0, off by default) */
+#define NUNCHUCK_FROZEN_REPEATS_MAX (1 << 20)
 #define usleep(micro_sec) usleep_range(micro_sec, micro_sec + 500)
 
-struct task_struct *nunchuck_tsk;
+/* defined by make DEBUG=1 */
+#ifdef NUNCHUCK_DEBUG
+    #define DUMP_STACK() dump_stack()
+#else
+    #define DUMP_STACK() ;
+#endif /* NUNCHUCK_DEBUG */
 
-struct nunchuck_dev {
-    struct i2c_client *i2c_client;
-    struct input_dev *input_dev;
-};
+static struct dentry *nunchuck_debugfs_root;
+
+static unsigned int ring_samples = NUNCHUCK_RING_SAMPLES;
+module_param(ring_samples, uint, S_IRUGO);
 
 struct nunchuck_signal {
     int jx;
@@ -31,160 +77,293 @@ struct nunchuck_signal {
     int az;
 };
 
-#define ABS(i) (((i) < 0)? (-1 * (i)) : (i))
-
-struct nunchuck_params {
-    int joystick_scale_factor;
-    unsigned int thread_sleep_ms;
-    int joystick_ignore_threshold;
-    struct mutex lock;
+enum nunchuck_stage {
+    NUNCHUCK_STAGE_SCHED,
+    NUNCHUCK_STAGE_WAIT,
+    NUNCHUCK_STAGE_XFER,
+    NUNCHUCK_STAGE_PARSE,
+    NUNCHUCK_STAGE_REPORT,
+    NUNCHUCK_STAGES,
 };
 
-struct nunchuck_params params = {
-    .joystick_scale_factor = JOYSTICK_SCALE_FACTOR,
-    .thread_sleep_ms = THREAD_SLEEP_MS,
-    .joystick_ignore_threshold = JOYSTICK_IGNORE_THREASHOLD,
+static const char* const nunchuck_stage_names[NUNCHUCK_STAGES] = {
+    "sched", "wait", "xfer", "parse", "report",
 };
 
-struct kobject attr_kobj = {
-    .name = "control",
+/* bucket b counts durations below 2^(b + 10) ns, the last one the rest */
+#define NUNCHUCK_HIST_BUCKETS 24
+
+/*
+ * Sampling pipeline statistics, shown in debugfs. Written by the work
+ * only, except missed_periods which the timer counts.
+ */
+struct nunchuck_stats {
+    u64 hist[NUNCHUCK_STAGES][NUNCHUCK_HIST_BUCKETS];
+    u64 total_ns[NUNCHUCK_STAGES];
+    u64 max_ns[NUNCHUCK_STAGES];
+    u64 samples;
+    u64 retries;
+    u64 missed_periods;
+    /* also shown in sysfs */
+    unsigned long bus_errors;
+    unsigned long reinits;
+    unsigned long invalid_frames;   /* all ones or all zeros */
+    unsigned long frozen_frames;    /* unchanged for frozen_repeats frames */
 };
 
-static ssize_t scale_factor_show(struct device* dev,
-        struct device_attribute *attr, char* buffer)
-{
-    int scf;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    scf = params.joystick_scale_factor;
-    mutex_unlock(&params.lock);
-    return sprintf(buffer, "%d\n", scf);
-}
-
-static ssize_t scale_factor_store(struct device* dev,
-        struct device_attribute* attr, const char* buffer, size_t count)
-{
-    int scf = -1;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    sscanf(buffer, "%d", &scf);
-
-    if (scf == -1) {
-        mutex_unlock(&params.lock);
-        return -EINVAL;
-    }
+/*
+ * Per-device tunables, set from sysfs and read by the sampling work
+ * without locking; each one is consumed independently.
+ */
+struct nunchuck_params {
+    atomic_t joystick_scale_factor;
+    atomic_t thread_sleep_ms;
+    atomic_t joystick_ignore_threshold;
+    atomic_t idle_timeout_ms;   /* 0 never backs off */
+    atomic_t idle_sleep_ms;
+    atomic_t activity_threshold;
+    atomic_t center_x;          /* raw joystick reading at rest */
+    atomic_t center_y;
+    atomic_t smoothing;         /* 0 (off) .. 255 (heaviest) */
+    atomic_t frozen_repeats;    /* 0 never takes identical frames as stuck */
+    atomic_t accel_curve[NUNCHUCK_CURVE_POINTS];
+};
 
-    params.joystick_scale_factor = scf;
+/*
+ * Raw sample ring and its consumers' state. Open files and mappings hold a
+ * reference so that it outlives the device on unbind; dead is set then.
+ */
+struct nunchuck_raw {
+    struct kref ref;
+    struct nunchuck_ring *ring;
+    u32 size;
+    u32 head;
+    u32 seq;
+    u32 dropped;                /* authoritative, mirrored into ring */
+    atomic_t users;             /* open files and mappings */
+    bool dead;
+    wait_queue_head_t wait;
+    struct mutex lock;          /* serialises read() consumers */
+};
 
-    mutex_unlock(&params.lock);
-    return count;
-}
+/*
+ * Sampling is driven by an hrtimer that fires every sleep_ms and queues
+ * work, which reads the conversion requested on the previous tick and
+ * requests the next one in the same transfer. The conversion time thus
+ * overlaps the period instead of adding to it.
+ */
+struct nunchuck_dev {
+    struct i2c_client *i2c_client;
+    struct input_dev *input_dev;
+    struct input_dev *accel_dev;
+    struct hrtimer timer;
+    struct work_struct work;
+    unsigned int sleep_ms;      /* period used by the timer */
+    bool requested;
+    bool stopping;
+    bool idle;
+    unsigned long last_active;  /* jiffies of the last input change */
+    struct nunchuck_signal last;    /* previous sample, as reported */
+    struct nunchuck_params params;
+    int smooth_x;               /* filter state, Q8 */
+    int smooth_y;
+
+    ktime_t fired;              /* last timer expiry */
+    ktime_t requested_at;       /* end of the last conversion request */
+    unsigned int errors;        /* consecutive failed samples */
+    unsigned int repeats;       /* consecutive frames equal to frame */
+    u8 frame[6];                /* last frame read */
+    struct nunchuck_stats stats;
+    struct dentry *debugfs;
+
+    /* raw sample ring, produced by the work and shared with user space */
+    struct nunchuck_raw *raw;
+    struct miscdevice raw_misc;
+
+#ifdef NUNCHUCK_IIO
+    struct iio_dev *indio_dev;
+#endif
+};
 
-static DEVICE_ATTR(scale_factor, S_IRUGO | S_IWUSR , scale_factor_show, scale_factor_store);
+#define ABS(i) (((i) < 0)? (-1 * (i)) : (i))
 
-static ssize_t sleep_ms_show(struct device* dev,
+/*
+ * show/store pair for a member of nunchuck_dev.params, stores outside
+ * _min.._max are rejected.
+ */
+#define NUNCHUCK_PARAM_ATTR(_name, _field, _min, _max) \
+    static ssize_t _name##_show(struct device* dev, \
+            struct device_attribute* attr, char* buffer) \
+    { \
+        struct nunchuck_dev *nunchuck = dev_get_drvdata(dev); \
+        return sprintf(buffer, "%d\n", \
+                atomic_read(&nunchuck->params._field)); \
+    } \
+    static ssize_t _name##_store(struct device* dev, \
+            struct device_attribute* attr, const char* buffer, \
+            size_t count) \
+    { \
+        struct nunchuck_dev *nunchuck = dev_get_drvdata(dev); \
+        int val; \
+        if (kstrtoint(buffer, 0, &val) || val < (_min) || val > (_max)) \
+            return -EINVAL; \
+        atomic_set(&nunchuck->params._field, val); \
+        return count; \
+    } \
+    static DEVICE_ATTR(_name, S_IRUGO | S_IWUSR, _name##_show, _name##_store);
+
+NUNCHUCK_PARAM_ATTR(scale_factor, joystick_scale_factor, 1, INT_MAX)
+NUNCHUCK_PARAM_ATTR(sleep_ms, thread_sleep_ms, 1, INT_MAX)
+NUNCHUCK_PARAM_ATTR(threshold, joystick_ignore_threshold, 0, INT_MAX)
+NUNCHUCK_PARAM_ATTR(idle_timeout_ms, idle_timeout_ms, 0, INT_MAX)
+NUNCHUCK_PARAM_ATTR(idle_sleep_ms, idle_sleep_ms, 1, INT_MAX)
+NUNCHUCK_PARAM_ATTR(activity_threshold, activity_threshold, 0, INT_MAX)
+NUNCHUCK_PARAM_ATTR(center_x, center_x, 0, 255)
+NUNCHUCK_PARAM_ATTR(center_y, center_y, 0, 255)
+NUNCHUCK_PARAM_ATTR(smoothing, smoothing, 0, 255)
+NUNCHUCK_PARAM_ATTR(frozen_repeats, frozen_repeats, 0,
+        NUNCHUCK_FROZEN_REPEATS_MAX)
+
+static ssize_t accel_curve_show(struct device* dev,
         struct device_attribute* attr, char* buffer)
 {
-    unsigned int sms;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    sms = params.thread_sleep_ms;
-    mutex_unlock(&params.lock);
-    return sprintf(buffer, "%u\n", sms);
+    struct nunchuck_dev *nunchuck = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < NUNCHUCK_CURVE_POINTS; i++)
+        len += sprintf(buffer + len, "%d%c",
+                atomic_read(&nunchuck->params.accel_curve[i]),
+                i == NUNCHUCK_CURVE_POINTS - 1 ? '\n' : ' ');
+    return len;
 }
 
-static ssize_t sleep_ms_store(struct device* dev,
+static ssize_t accel_curve_store(struct device* dev,
         struct device_attribute* attr, const char* buffer, size_t count)
 {
-    unsigned int sms = 0;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    sscanf(buffer, "%u", &sms);
+    struct nunchuck_dev *nunchuck = dev_get_drvdata(dev);
+    int gain[NUNCHUCK_CURVE_POINTS];
+    int i;
 
-    if (sms <= 0) {
-        mutex_unlock(&params.lock);
+    if (sscanf(buffer, "%d %d %d %d %d %d %d %d", &gain[0], &gain[1],
+                &gain[2], &gain[3], &gain[4], &gain[5], &gain[6],
+                &gain[7]) != NUNCHUCK_CURVE_POINTS)
         return -EINVAL;
-    }
 
-    params.thread_sleep_ms = sms;
+    for (i = 0; i < NUNCHUCK_CURVE_POINTS; i++)
+        if (gain[i] < 0 || gain[i] > NUNCHUCK_GAIN_MAX)
+            return -EINVAL;
 
-    mutex_unlock(&params.lock);
+    for (i = 0; i < NUNCHUCK_CURVE_POINTS; i++)
+        atomic_set(&nunchuck->params.accel_curve[i], gain[i]);
     return count;
 }
 
-static DEVICE_ATTR(sleep_ms, S_IRUGO | S_IWUSR, sleep_ms_show, sleep_ms_store);
+static DEVICE_ATTR(accel_curve, S_IRUGO | S_IWUSR, accel_curve_show,
+        accel_curve_store);
 
-static ssize_t threshold_show(struct device* dev,
-        struct device_attribute *attr, char* buffer)
-{
-    int sts;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    sts = params.joystick_ignore_threshold;
-    mutex_unlock(&params.lock);
-    return sprintf(buffer, "%u\n", sts);
-}
-
-static ssize_t threshold_store(struct device* dev,
-        struct device_attribute* attr, const char* buffer, size_t count)
+static ssize_t dropped_show(struct device* dev,
+        struct device_attribute* attr, char* buffer)
 {
-    int sts = -1;
-    if (mutex_lock_interruptible(&params.lock))
-        return -EIO;
-    sscanf(buffer, "%d", &sts);
-
-    if (sts < 0) {
-        mutex_unlock(&params.lock);
-        return -EINVAL;
-    }
-
-    params.joystick_ignore_threshold = sts;
-
-    mutex_unlock(&params.lock);
-    return count;
+    struct nunchuck_dev *nunchuck = dev_get_drvdata(dev);
+    return sprintf(buffer, "%u\n", READ_ONCE(nunchuck->raw->dropped));
 }
 
-static DEVICE_ATTR(threshold, S_IRUGO | S_IWUSR, threshold_show, threshold_store);
+static DEVICE_ATTR(dropped, S_IRUGO, dropped_show, NULL);
+
+/*
+ * Read-only view of a counter in nunchuck_dev.stats
+ */
+#define NUNCHUCK_STAT_ATTR(_name) \
+    static ssize_t _name##_show(struct device* dev, \
+            struct device_attribute* attr, char* buffer) \
+    { \
+        struct nunchuck_dev *nunchuck = dev_get_drvdata(dev); \
+        return sprintf(buffer, "%lu\n", \
+                READ_ONCE(nunchuck->stats._name)); \
+    } \
+    static DEVICE_ATTR(_name, S_IRUGO, _name##_show, NULL);
+
+NUNCHUCK_STAT_ATTR(bus_errors)
+NUNCHUCK_STAT_ATTR(reinits)
+NUNCHUCK_STAT_ATTR(invalid_frames)
+NUNCHUCK_STAT_ATTR(frozen_frames)
 
 const struct attribute* nunparam_attrs[] = {
     &dev_attr_threshold.attr,
     &dev_attr_scale_factor.attr,
     &dev_attr_sleep_ms.attr,
+    &dev_attr_idle_timeout_ms.attr,
+    &dev_attr_idle_sleep_ms.attr,
+    &dev_attr_activity_threshold.attr,
+    &dev_attr_center_x.attr,
+    &dev_attr_center_y.attr,
+    &dev_attr_smoothing.attr,
+    &dev_attr_frozen_repeats.attr,
+    &dev_attr_accel_curve.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_bus_errors.attr,
+    &dev_attr_reinits.attr,
+    &dev_attr_invalid_frames.attr,
+    &dev_attr_frozen_frames.attr,
     NULL,
 };
 
+static void nunchuck_params_init(struct nunchuck_params* params)
+{
+    int i;
+
+    atomic_set(&params->joystick_scale_factor, JOYSTICK_SCALE_FACTOR);
+    atomic_set(&params->thread_sleep_ms, THREAD_SLEEP_MS);
+    atomic_set(&params->joystick_ignore_threshold,
+            JOYSTICK_IGNORE_THREASHOLD);
+    atomic_set(&params->idle_timeout_ms, IDLE_TIMEOUT_MS);
+    atomic_set(&params->idle_sleep_ms, IDLE_SLEEP_MS);
+    atomic_set(&params->activity_threshold, ACTIVITY_THRESHOLD);
+    atomic_set(&params->center_x, JOYSTICK_CENTER);
+    atomic_set(&params->center_y, JOYSTICK_CENTER);
+    atomic_set(&params->smoothing, 0);
+    atomic_set(&params->frozen_repeats, 0);
+    for (i = 0; i < NUNCHUCK_CURVE_POINTS; i++)
+        atomic_set(&params->accel_curve[i], 256);
+}
+
+/*
+ * Decode a frame; the joystick is left raw (0..255) for nunchuck_filter().
+ */
 int parse_nunchuck_signal(struct nunchuck_signal* signal,
-        char* buf, int count, int scale_factor, int threshold)
+        char* data, int count)
 {
+    u8 *buf = (u8*) data;
+
     if (count < 6)
         return -1;
 
-    signal->jx = (int) (buf[0] - (char) 128) / scale_factor;
-    signal->jy = (int) ((char) 128 - buf[1]) / scale_factor;
+    signal->jx = buf[0];
+    signal->jy = buf[1];
     signal->bz = (~buf[5]) & 0x01;
     signal->bc = ((~buf[5]) >> 1) & 0x01;
     signal->ax = (buf[5] >> 2 & 0x3) | (buf[2] << 2);
     signal->ay = (buf[5] >> 4 & 0x3) | (buf[3] << 2);
     signal->az = (buf[5] >> 6 & 0x3) | (buf[4] << 2);
 
-    if (ABS(signal->jx) < threshold)
-        signal->jx = 0;
-    if (ABS(signal->jy) < threshold)
-        signal->jy = 0;
-
     /*printk(KERN_INFO "[%s] jx: %d jy: %d bz: %d bc: %d ax: %d ay: %d az: %d\n",
             DRIVER_NAME, signal->jx, signal->jy, signal->bz, signal->bc,
             signal->ax, signal->ay, signal->az);*/
     return 0;
 }
 
+/*
+ * Only used for the init sequence, which needs the settle delay.
+ */
 int nunchuck_write_registers(struct i2c_client* client,
         char* buf, int count)
 {
     int status;
     status = i2c_master_send(client, buf, count);
     if (status < 0) {
-        printk(KERN_INFO "Error writing nunchuck\n");
+        dev_warn_ratelimited(&client->dev, "error writing init: %d\n",
+                status);
         return status;
     }
 
@@ -192,85 +371,843 @@ int nunchuck_write_registers(struct i2c_client* client,
     return status;
 }
 
-int nunchuck_read_registers(struct i2c_client* client,
-        char* buf, int count)
+/*
+ * Disable encryption; also sent again to recover a controller that was
+ * replugged or stopped answering.
+ */
+static int nunchuck_init_sequence(struct i2c_client* client)
 {
+    char init1[] = {0xf0, 0x55};
+    char init2[] = {0xfb, 0x00};
     int status;
-    char read[] = {0x00};
-
-    msleep(10);
-    nunchuck_write_registers(client, read, sizeof(read));
-    msleep(9);
 
-    status = i2c_master_recv(client, buf, count);
-    if (status < 0) {
-        printk(KERN_INFO "Error writing nunchuck\n");
+    status = nunchuck_write_registers(client, init1, sizeof(init1));
+    if (status < 0)
         return status;
+    return nunchuck_write_registers(client, init2, sizeof(init2));
+}
+
+/*
+ * One sample costs one bus transaction: read the conversion requested on
+ * the previous tick, then (repeated start) request the next conversion.
+ * Without a pending request only the request is sent.
+ */
+static int nunchuck_xfer(struct i2c_client* client, char* buf, int count,
+        bool read)
+{
+    char req[] = {0x00};
+    struct i2c_msg msgs[] = {
+        {
+            .addr = client->addr,
+            .flags = I2C_M_RD,
+            .len = count,
+            .buf = (u8*) buf,
+        },
+        {
+            .addr = client->addr,
+            .flags = 0,
+            .len = sizeof(req),
+            .buf = (u8*) req,
+        },
+    };
+    struct i2c_msg *m = read ? msgs : msgs + 1;
+    int num = read ? 2 : 1;
+    int status;
+
+    status = i2c_transfer(client->adapter, m, num);
+    if (status != num)
+        return status < 0 ? status : -EIO;
+    return 0;
+}
+
+/*
+ * A held joystick keeps moving the pointer, so it counts as activity even
+ * when the sample does not change.
+ */
+static bool nunchuck_changed(const struct nunchuck_signal* a,
+        const struct nunchuck_signal* b, int threshold)
+{
+    return a->jx || a->jy || a->jx != b->jx || a->jy != b->jy ||
+        a->bz != b->bz || a->bc != b->bc ||
+        ABS(a->ax - b->ax) > threshold ||
+        ABS(a->ay - b->ay) > threshold ||
+        ABS(a->az - b->az) > threshold;
+}
+
+/*
+ * Emit only the fields that changed since the previous sample and sync
+ * only the devices that got an event, so evdev readers are not woken for
+ * nothing. The joystick is relative motion and is reported while held.
+ */
+static void nunchuck_report(struct nunchuck_dev* nunchuck,
+        const struct nunchuck_signal* sig)
+{
+    struct input_dev* input = nunchuck->input_dev;
+    struct input_dev* accel = nunchuck->accel_dev;
+    const struct nunchuck_signal* last = &nunchuck->last;
+    bool sync = false;
+
+    if (sig->bc != last->bc) {
+        input_report_key(input, BTN_LEFT, sig->bc);
+        sync = true;
+    }
+    if (sig->bz != last->bz) {
+        input_report_key(input, BTN_RIGHT, sig->bz);
+        sync = true;
     }
+    if (sig->jx) {
+        input_report_rel(input, REL_X, sig->jx);
+        sync = true;
+    }
+    if (sig->jy) {
+        input_report_rel(input, REL_Y, sig->jy);
+        sync = true;
+    }
+    if (sync)
+        input_sync(input);
 
-    return status;
+    sync = false;
+    if (sig->ax != last->ax) {
+        input_report_abs(accel, ABS_X, sig->ax);
+        sync = true;
+    }
+    if (sig->ay != last->ay) {
+        input_report_abs(accel, ABS_Y, sig->ay);
+        sync = true;
+    }
+    if (sig->az != last->az) {
+        input_report_abs(accel, ABS_Z, sig->az);
+        sync = true;
+    }
+    if (sync)
+        input_sync(accel);
+}
+
+/*
+ * Single producer side of the raw ring. head and the samples are private
+ * to the driver until head is published; tail comes from user space and
+ * is only trusted as far as it is consistent with head.
+ */
+static void nunchuck_ring_push(struct nunchuck_dev* nunchuck,
+        const char* data, ktime_t ts)
+{
+    struct nunchuck_raw *raw = nunchuck->raw;
+    struct nunchuck_ring *ring = raw->ring;
+    const u8 *buf = (const u8*) data;
+    struct nunchuck_sample *sample;
+    u32 head = raw->head;
+    u32 tail = smp_load_acquire(&ring->tail);
+    u32 seq = raw->seq++;
+
+    if (head - tail >= raw->size) {
+        WRITE_ONCE(raw->dropped, raw->dropped + 1);
+        WRITE_ONCE(ring->dropped, raw->dropped);
+        return;
+    }
+
+    sample = &ring->samples[head & (raw->size - 1)];
+    sample->ts_ns = ktime_to_ns(ts);
+    sample->jx = (int) buf[0] - 128;
+    sample->jy = 128 - (int) buf[1];
+    sample->ax = (buf[5] >> 2 & 0x3) | (buf[2] << 2);
+    sample->ay = (buf[5] >> 4 & 0x3) | (buf[3] << 2);
+    sample->az = (buf[5] >> 6 & 0x3) | (buf[4] << 2);
+    sample->buttons = (~buf[5] & 0x01 ? NUNCHUCK_BTN_Z : 0) |
+        (~buf[5] & 0x02 ? NUNCHUCK_BTN_C : 0);
+    sample->seq = seq;
+
+    raw->head = head + 1;
+    smp_store_release(&ring->head, head + 1);
+    wake_up_interruptible(&raw->wait);
+}
+
+static void nunchuck_raw_free(struct kref* ref)
+{
+    struct nunchuck_raw *raw = container_of(ref, struct nunchuck_raw, ref);
+
+    vfree(raw->ring);
+    kfree(raw);
+}
+
+static int nunchuck_raw_open(struct inode* inode, struct file* filp)
+{
+    /* misc_open() set private_data and keeps the device registered */
+    struct nunchuck_dev *nunchuck =
+        container_of(filp->private_data, struct nunchuck_dev, raw_misc);
+
+    kref_get(&nunchuck->raw->ref);
+    atomic_inc(&nunchuck->raw->users);
+    filp->private_data = nunchuck->raw;
+    return 0;
+}
+
+static int nunchuck_raw_release(struct inode* inode, struct file* filp)
+{
+    struct nunchuck_raw *raw = filp->private_data;
+
+    atomic_dec(&raw->users);
+    kref_put(&raw->ref, nunchuck_raw_free);
+    return 0;
+}
+
+/*
+ * Drain whole samples, blocking until at least one is queued unless the
+ * file is non-blocking. Fails with -ENODEV once the device is gone.
+ */
+static ssize_t nunchuck_raw_read(struct file* filp, char __user *buf,
+        size_t count, loff_t *f_pos)
+{
+    struct nunchuck_raw *raw = filp->private_data;
+    struct nunchuck_ring *ring = raw->ring;
+    size_t want = count / sizeof(struct nunchuck_sample);
+    size_t n = 0;
+    u32 head, tail;
+    ssize_t retval;
+
+    if (!want)
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&raw->lock))
+        return -ERESTARTSYS;
+
+    for (;;) {
+        if (READ_ONCE(raw->dead)) {
+            retval = -ENODEV;
+            goto out;
+        }
+        head = smp_load_acquire(&ring->head);
+        tail = READ_ONCE(ring->tail);
+        if (head - tail > raw->size)
+            tail = head - raw->size;
+        if (head != tail)
+            break;
+
+        mutex_unlock(&raw->lock);
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(raw->wait, READ_ONCE(raw->dead) ||
+                    smp_load_acquire(&ring->head) != READ_ONCE(ring->tail)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&raw->lock))
+            return -ERESTARTSYS;
+    }
+
+    want = min_t(size_t, want, head - tail);
+    while (n < want) {
+        u32 idx = (tail + n) & (raw->size - 1);
+        size_t chunk = min_t(size_t, want - n, raw->size - idx);
+
+        if (copy_to_user(buf + n * sizeof(struct nunchuck_sample),
+                    &ring->samples[idx],
+                    chunk * sizeof(struct nunchuck_sample))) {
+            retval = -EFAULT;
+            goto out;
+        }
+        n += chunk;
+    }
+
+    smp_store_release(&ring->tail, tail + n);
+    retval = n * sizeof(struct nunchuck_sample);
+out:
+    mutex_unlock(&raw->lock);
+    return retval;
+}
+
+static unsigned int nunchuck_raw_poll(struct file* filp, poll_table* wait)
+{
+    struct nunchuck_raw *raw = filp->private_data;
+    struct nunchuck_ring *ring = raw->ring;
+
+    poll_wait(filp, &raw->wait, wait);
+    if (READ_ONCE(raw->dead))
+        return POLLHUP | POLLERR;
+    if (smp_load_acquire(&ring->head) != READ_ONCE(ring->tail))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+static void nunchuck_raw_vm_open(struct vm_area_struct* vma)
+{
+    struct nunchuck_raw *raw = vma->vm_private_data;
+
+    kref_get(&raw->ref);
+    atomic_inc(&raw->users);
+}
+
+static void nunchuck_raw_vm_close(struct vm_area_struct* vma)
+{
+    struct nunchuck_raw *raw = vma->vm_private_data;
+
+    atomic_dec(&raw->users);
+    kref_put(&raw->ref, nunchuck_raw_free);
+}
+
+static const struct vm_operations_struct nunchuck_raw_vm_ops = {
+    .open = nunchuck_raw_vm_open,
+    .close = nunchuck_raw_vm_close,
+};
+
+static int nunchuck_raw_mmap(struct file* filp, struct vm_area_struct* vma)
+{
+    struct nunchuck_raw *raw = filp->private_data;
+    int result;
+
+    result = remap_vmalloc_range(vma, raw->ring, vma->vm_pgoff);
+    if (result)
+        return result;
+
+    vma->vm_private_data = raw;
+    vma->vm_ops = &nunchuck_raw_vm_ops;
+    nunchuck_raw_vm_open(vma);
+    return 0;
+}
+
+static const struct file_operations nunchuck_raw_fops = {
+    .owner = THIS_MODULE,
+    .open = nunchuck_raw_open,
+    .release = nunchuck_raw_release,
+    .read = nunchuck_raw_read,
+    .poll = nunchuck_raw_poll,
+    .mmap = nunchuck_raw_mmap,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
+    .llseek = no_llseek,    /* the default since 6.12 removed it */
+#endif
+};
+
+static int nunchuck_ring_init(struct nunchuck_dev* nunchuck,
+        struct device* dev)
+{
+    u32 size = roundup_pow_of_two(max(ring_samples, 2U));
+    struct nunchuck_raw *raw;
+
+    nunchuck->raw_misc.name = devm_kasprintf(dev, GFP_KERNEL,
+            DRIVER_NAME "-raw-%s", dev_name(dev));
+    if (!nunchuck->raw_misc.name)
+        return -ENOMEM;
+
+    raw = kzalloc(sizeof(struct nunchuck_raw), GFP_KERNEL);
+    if (!raw)
+        return -ENOMEM;
+
+    raw->ring = vmalloc_user(sizeof(struct nunchuck_ring) +
+            size * sizeof(struct nunchuck_sample));
+    if (!raw->ring) {
+        kfree(raw);
+        return -ENOMEM;
+    }
+
+    raw->ring->size = size;
+    raw->size = size;
+    kref_init(&raw->ref);
+    init_waitqueue_head(&raw->wait);
+    mutex_init(&raw->lock);
+    nunchuck->raw = raw;
+
+    nunchuck->raw_misc.minor = MISC_DYNAMIC_MINOR;
+    nunchuck->raw_misc.fops = &nunchuck_raw_fops;
+    nunchuck->raw_misc.parent = dev;
+    return 0;
 }
 
-static int nunchuck_thread(void* data)
+/*
+ * Called once the work is stopped: wake readers so they see the device is
+ * gone and drop the driver's reference; open files keep the ring alive.
+ */
+static void nunchuck_ring_remove(struct nunchuck_dev* nunchuck)
+{
+    struct nunchuck_raw *raw = nunchuck->raw;
+
+    WRITE_ONCE(raw->dead, true);
+    wake_up_interruptible_all(&raw->wait);
+    kref_put(&raw->ref, nunchuck_raw_free);
+}
+
+#ifdef NUNCHUCK_IIO
+/*
+ * The accelerometer is also an IIO device with a software kfifo buffer
+ * fed by the polling work, so the poll timer acts as the trigger and
+ * sampling_frequency maps onto sleep_ms.
+ */
+#define NUNCHUCK_IIO_ACCEL(_axis, _index) { \
+    .type = IIO_ACCEL, \
+    .modified = 1, \
+    .channel2 = IIO_MOD_##_axis, \
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW), \
+    .info_mask_shared_by_all = BIT(IIO_CHAN_INFO_SAMP_FREQ), \
+    .scan_index = _index, \
+    .scan_type = { \
+        .sign = 'u', \
+        .realbits = 10, \
+        .storagebits = 16, \
+        .endianness = IIO_CPU, \
+    }, \
+}
+
+static const struct iio_chan_spec nunchuck_iio_channels[] = {
+    NUNCHUCK_IIO_ACCEL(X, 0),
+    NUNCHUCK_IIO_ACCEL(Y, 1),
+    NUNCHUCK_IIO_ACCEL(Z, 2),
+    IIO_CHAN_SOFT_TIMESTAMP(3),
+};
+
+/* the work always pushes all three axes, the core demuxes subsets */
+static const unsigned long nunchuck_iio_scan_masks[] = { 0x7, 0 };
+
+static struct nunchuck_dev* nunchuck_from_iio(struct iio_dev* indio_dev)
+{
+    return *(struct nunchuck_dev**) iio_priv(indio_dev);
+}
+
+static int nunchuck_iio_read_raw(struct iio_dev* indio_dev,
+        struct iio_chan_spec const* chan, int* val, int* val2, long mask)
+{
+    struct nunchuck_dev *nunchuck = nunchuck_from_iio(indio_dev);
+
+    switch (mask) {
+        case IIO_CHAN_INFO_RAW:
+            switch (chan->channel2) {
+                case IIO_MOD_X:
+                    *val = READ_ONCE(nunchuck->last.ax);
+                    break;
+                case IIO_MOD_Y:
+                    *val = READ_ONCE(nunchuck->last.ay);
+                    break;
+                default:
+                    *val = READ_ONCE(nunchuck->last.az);
+                    break;
+            }
+            return IIO_VAL_INT;
+
+        case IIO_CHAN_INFO_SAMP_FREQ:
+            *val = 1000;
+            *val2 = atomic_read(&nunchuck->params.thread_sleep_ms);
+            return IIO_VAL_FRACTIONAL;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static int nunchuck_iio_write_raw(struct iio_dev* indio_dev,
+        struct iio_chan_spec const* chan, int val, int val2, long mask)
+{
+    struct nunchuck_dev *nunchuck = nunchuck_from_iio(indio_dev);
+    long mhz = (long) val * 1000 + val2 / 1000;
+
+    if (mask != IIO_CHAN_INFO_SAMP_FREQ || mhz <= 0)
+        return -EINVAL;
+
+    atomic_set(&nunchuck->params.thread_sleep_ms,
+            max(1L, DIV_ROUND_CLOSEST(1000000L, mhz)));
+    return 0;
+}
+
+static const struct iio_info nunchuck_iio_info = {
+    .read_raw = nunchuck_iio_read_raw,
+    .write_raw = nunchuck_iio_write_raw,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+    /* later iio_device_register() takes THIS_MODULE itself */
+    .driver_module = THIS_MODULE,
+#endif
+};
+
+static int nunchuck_iio_init(struct nunchuck_dev* nunchuck,
+        struct device* dev)
+{
+    struct iio_dev *indio_dev;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+    struct iio_buffer *buffer;
+#endif
+    int result;
+
+    indio_dev = devm_iio_device_alloc(dev, sizeof(struct nunchuck_dev*));
+    if (!indio_dev)
+        return -ENOMEM;
+
+    *(struct nunchuck_dev**) iio_priv(indio_dev) = nunchuck;
+    indio_dev->dev.parent = dev;
+    indio_dev->name = DRIVER_NAME;
+    indio_dev->info = &nunchuck_iio_info;
+    indio_dev->channels = nunchuck_iio_channels;
+    indio_dev->num_channels = ARRAY_SIZE(nunchuck_iio_channels);
+    indio_dev->available_scan_masks = nunchuck_iio_scan_masks;
+    indio_dev->modes = INDIO_DIRECT_MODE | INDIO_BUFFER_SOFTWARE;
+
+    /* 5.13 replaced allocate and attach by one call, 6.0 dropped its modes */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    result = devm_iio_kfifo_buffer_setup(dev, indio_dev, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+    result = devm_iio_kfifo_buffer_setup(dev, indio_dev,
+            INDIO_BUFFER_SOFTWARE, NULL);
+#else
+    buffer = devm_iio_kfifo_allocate(dev);
+    result = buffer ? 0 : -ENOMEM;
+    if (buffer)
+        iio_device_attach_buffer(indio_dev, buffer);
+#endif
+    if (result)
+        return result;
+
+    nunchuck->indio_dev = indio_dev;
+    return iio_device_register(indio_dev);
+}
+
+static void nunchuck_iio_remove(struct nunchuck_dev* nunchuck)
+{
+    iio_device_unregister(nunchuck->indio_dev);
+}
+
+static bool nunchuck_iio_capturing(struct nunchuck_dev* nunchuck)
+{
+    return iio_buffer_enabled(nunchuck->indio_dev);
+}
+
+static void nunchuck_iio_push(struct nunchuck_dev* nunchuck,
+        const struct nunchuck_signal* sig)
+{
+    struct iio_dev *indio_dev = nunchuck->indio_dev;
+    struct {
+        u16 accel[3];
+        s64 ts __aligned(8);
+    } scan;
+
+    if (!iio_buffer_enabled(indio_dev))
+        return;
+
+    scan.accel[0] = sig->ax;
+    scan.accel[1] = sig->ay;
+    scan.accel[2] = sig->az;
+    iio_push_to_buffers_with_timestamp(indio_dev, &scan,
+            iio_get_time_ns(indio_dev));
+}
+#else
+static inline int nunchuck_iio_init(struct nunchuck_dev* nunchuck,
+        struct device* dev)
+{
+    return 0;
+}
+
+static inline void nunchuck_iio_remove(struct nunchuck_dev* nunchuck)
+{
+}
+
+static inline bool nunchuck_iio_capturing(struct nunchuck_dev* nunchuck)
+{
+    return false;
+}
+
+static inline void nunchuck_iio_push(struct nunchuck_dev* nunchuck,
+        const struct nunchuck_signal* sig)
+{
+}
+#endif /* NUNCHUCK_IIO */
+
+/*
+ * An IIO capture promises sampling_frequency and the raw ring every
+ * sample, so neither may be slowed down by the idle back-off.
+ */
+static bool nunchuck_capturing(struct nunchuck_dev* nunchuck)
+{
+    return atomic_read(&nunchuck->raw->users) ||
+        nunchuck_iio_capturing(nunchuck);
+}
+
+/*
+ * Apply the gain of the acceleration curve, linearly interpolated between
+ * the table points, to the deflection v.
+ */
+static int nunchuck_curve(struct nunchuck_params* params, int v)
+{
+    int pos = min(ABS(v), 127) * (NUNCHUCK_CURVE_POINTS - 1);
+    int idx = pos >> 7;
+    int frac = pos & 127;
+    int g0 = atomic_read(&params->accel_curve[idx]);
+    int g1 = atomic_read(&params->accel_curve[idx + 1]);
+
+    return v * (g0 + ((g1 - g0) * frac >> 7)) / 256;
+}
+
+/*
+ * Joystick pipeline, all integer: subtract the calibrated center, smooth
+ * with an exponential moving average kept in Q8, shape with the
+ * acceleration curve, scale down and apply the dead zone.
+ */
+static void nunchuck_filter(struct nunchuck_dev* nunchuck,
+        struct nunchuck_signal* sig)
+{
+    struct nunchuck_params* params = &nunchuck->params;
+    int scale_factor = atomic_read(&params->joystick_scale_factor);
+    int threshold = atomic_read(&params->joystick_ignore_threshold);
+    int alpha = 256 - min(atomic_read(&params->smoothing), 255);
+    int jx = sig->jx - atomic_read(&params->center_x);
+    int jy = atomic_read(&params->center_y) - sig->jy;
+
+    nunchuck->smooth_x += (jx * 256 - nunchuck->smooth_x) * alpha / 256;
+    nunchuck->smooth_y += (jy * 256 - nunchuck->smooth_y) * alpha / 256;
+
+    jx = nunchuck_curve(params, nunchuck->smooth_x / 256) / scale_factor;
+    jy = nunchuck_curve(params, nunchuck->smooth_y / 256) / scale_factor;
+
+    sig->jx = ABS(jx) < threshold ? 0 : jx;
+    sig->jy = ABS(jy) < threshold ? 0 : jy;
+}
+
+static u64 nunchuck_account(struct nunchuck_dev* nunchuck,
+        enum nunchuck_stage stage, ktime_t start, ktime_t end)
+{
+    struct nunchuck_stats *st = &nunchuck->stats;
+    u64 ns = ktime_to_ns(ktime_sub(end, start));
+    int b = clamp(fls64(ns) - 10, 0, NUNCHUCK_HIST_BUCKETS - 1);
+
+    st->hist[stage][b]++;
+    st->total_ns[stage] += ns;
+    if (ns > st->max_ns[stage])
+        st->max_ns[stage] = ns;
+    return ns;
+}
+
+static int nunchuck_stats_show(struct seq_file* s, void* v)
+{
+    struct nunchuck_dev *nunchuck = s->private;
+    struct nunchuck_stats *st = &nunchuck->stats;
+    u64 count;
+    int i, b;
+
+    seq_printf(s, "samples %llu\nbus_errors %lu\nretries %llu\n"
+            "missed_periods %llu\nreinits %lu\ninvalid_frames %lu\n"
+            "frozen_frames %lu\n",
+            st->samples, st->bus_errors, st->retries, st->missed_periods,
+            st->reinits, st->invalid_frames, st->frozen_frames);
+
+    for (i = 0; i < NUNCHUCK_STAGES; i++) {
+        for (count = 0, b = 0; b < NUNCHUCK_HIST_BUCKETS; b++)
+            count += st->hist[i][b];
+
+        seq_printf(s, "\n%s: count %llu avg %llu ns max %llu ns\n",
+                nunchuck_stage_names[i], count,
+                count ? div64_u64(st->total_ns[i], count) : 0,
+                st->max_ns[i]);
+
+        for (b = 0; b < NUNCHUCK_HIST_BUCKETS; b++) {
+            if (!st->hist[i][b])
+                continue;
+            if (b == NUNCHUCK_HIST_BUCKETS - 1)
+                seq_printf(s, "  >= %10llu ns: %llu\n",
+                        1ULL << (b + 9), st->hist[i][b]);
+            else
+                seq_printf(s, "  <  %10llu ns: %llu\n",
+                        1ULL << (b + 10), st->hist[i][b]);
+        }
+    }
+    return 0;
+}
+
+static int nunchuck_stats_open(struct inode* inode, struct file* file)
+{
+    return single_open(file, nunchuck_stats_show, inode->i_private);
+}
+
+static const struct file_operations nunchuck_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = nunchuck_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * A controller that lost its init state reads as all ones, and so does an
+ * unplugged one on some adapters; all zeros is a stuck bus.
+ */
+static bool nunchuck_frame_valid(const char* buf, int count)
+{
+    return memchr_inv(buf, 0xff, count) && memchr_inv(buf, 0x00, count);
+}
+
+static void nunchuck_reinit(struct nunchuck_dev* nunchuck)
+{
+    nunchuck->stats.reinits++;
+    nunchuck->requested = false;
+    nunchuck->repeats = 0;
+    nunchuck_init_sequence(nunchuck->i2c_client);
+}
+
+/*
+ * Count a failed sample and re-initialise the controller every
+ * NUNCHUCK_REINIT_ERRORS failures in a row. nunchuck_work() stretches the
+ * period while errors is non-zero.
+ */
+static void nunchuck_fail(struct nunchuck_dev* nunchuck)
+{
+    if (++nunchuck->errors % NUNCHUCK_REINIT_ERRORS == 0)
+        nunchuck_reinit(nunchuck);
+}
+
+static ktime_t nunchuck_period(unsigned int sleep_ms)
+{
+    u64 ns = max_t(u64, (u64) sleep_ms * NSEC_PER_MSEC,
+            NUNCHUCK_CONVERSION_US * NSEC_PER_USEC);
+    return ns_to_ktime(ns);
+}
+
+static void nunchuck_work(struct work_struct *work)
 {
     struct nunchuck_dev* nunchuck =
-        (struct nunchuck_dev*) data;
+        container_of(work, struct nunchuck_dev, work);
 
-    struct input_dev* input = nunchuck->input_dev;
     struct i2c_client* client = nunchuck->i2c_client;
+    struct device* dev = &client->dev;
+    struct nunchuck_stats* st = &nunchuck->stats;
 
     char buf[6];
     struct nunchuck_signal sig;
+    bool requested = nunchuck->requested;
+    ktime_t t0, t1, t2;
+
+    struct nunchuck_params* params = &nunchuck->params;
+    unsigned int sleep_ms = atomic_read(&params->thread_sleep_ms);
+    unsigned int idle_timeout_ms = atomic_read(&params->idle_timeout_ms);
+    unsigned int idle_sleep_ms = atomic_read(&params->idle_sleep_ms);
+    int activity_threshold = atomic_read(&params->activity_threshold);
+    unsigned int frozen_repeats = atomic_read(&params->frozen_repeats);
+    unsigned int period_ms;
+    int status;
+    bool idle;
+
+    t0 = ktime_get();
+    trace_nunchuck_sched(dev, nunchuck_account(nunchuck,
+                NUNCHUCK_STAGE_SCHED, READ_ONCE(nunchuck->fired), t0));
+    if (requested)
+        trace_nunchuck_wait(dev, nunchuck_account(nunchuck,
+                    NUNCHUCK_STAGE_WAIT, nunchuck->requested_at, t0));
+    if (nunchuck->errors)
+        st->retries++;
+
+    status = nunchuck_xfer(client, buf, sizeof(buf), requested);
+    t1 = ktime_get();
+    trace_nunchuck_xfer(dev, nunchuck_account(nunchuck,
+                NUNCHUCK_STAGE_XFER, t0, t1));
+
+    nunchuck->requested = !status;
+    if (status < 0) {
+        st->bus_errors++;
+        trace_nunchuck_bus_error(dev, status);
+        dev_warn_ratelimited(dev, "error transferring sample: %d\n",
+                status);
+        nunchuck_fail(nunchuck);
+        goto out;
+    }
+    nunchuck->requested_at = t1;
+
+    if (requested && !nunchuck_frame_valid(buf, sizeof(buf))) {
+        st->invalid_frames++;
+        dev_warn_ratelimited(dev, "invalid frame %*ph\n",
+                (int) sizeof(buf), buf);
+        nunchuck_fail(nunchuck);
+        goto out;
+    }
 
-    int threshold;
-    unsigned int sleep_ms;
-    int scale_factor;
-
-    while (!kthread_should_stop()) {
-        if (nunchuck_read_registers(client, buf, sizeof(buf)) < 0)
-            goto next_loop;
-        if (mutex_lock_interruptible(&params.lock))
-            goto stop;
-
-        threshold = params.joystick_ignore_threshold;
-        sleep_ms = params.thread_sleep_ms;
-        scale_factor = params.joystick_scale_factor;
-
-        mutex_unlock(&params.lock);
-        if (!parse_nunchuck_signal(&sig, buf, sizeof(buf),
-                    scale_factor, threshold)) {
-            input_report_key(input, BTN_LEFT, sig.bc);
-            input_report_key(input, BTN_RIGHT, sig.bz);
-            input_report_rel(input, REL_X, sig.jx);
-            input_report_rel(input, REL_Y, sig.jy);
-            input_sync(input);
+    if (requested) {
+        if (nunchuck->errors)
+            dev_info(dev, "recovered after %u failed samples\n",
+                    nunchuck->errors);
+        nunchuck->errors = 0;
+
+        /*
+         * A controller at rest can repeat a frame for as long as it lies
+         * there, so this is only a hint for hardware known to be noisy.
+         */
+        if (memcmp(buf, nunchuck->frame, sizeof(buf))) {
+            memcpy(nunchuck->frame, buf, sizeof(buf));
+            nunchuck->repeats = 0;
+        } else if (frozen_repeats && ++nunchuck->repeats >= frozen_repeats) {
+            st->frozen_frames++;
+            dev_warn_ratelimited(dev, "frame unchanged for %u samples\n",
+                    nunchuck->repeats);
+            nunchuck_reinit(nunchuck);
         }
-next_loop:
-        msleep(params.thread_sleep_ms);
     }
-stop:
-    return 0;
+
+    if (requested && !parse_nunchuck_signal(&sig, buf, sizeof(buf))) {
+        nunchuck_filter(nunchuck, &sig);
+        t2 = ktime_get();
+        trace_nunchuck_parse(dev, nunchuck_account(nunchuck,
+                    NUNCHUCK_STAGE_PARSE, t1, t2));
+
+        nunchuck_report(nunchuck, &sig);
+        nunchuck_iio_push(nunchuck, &sig);
+        nunchuck_ring_push(nunchuck, buf, t1);
+        trace_nunchuck_report(dev, nunchuck_account(nunchuck,
+                    NUNCHUCK_STAGE_REPORT, t2, ktime_get()));
+        st->samples++;
+
+        if (nunchuck_changed(&sig, &nunchuck->last, activity_threshold))
+            nunchuck->last_active = jiffies;
+        nunchuck->last = sig;
+    }
+
+out:
+    /*
+     * Back off to idle_sleep_ms after idle_timeout_ms without a change,
+     * unless someone is capturing, and restart the timer at full rate on
+     * the first change. Failures double the period each time, up to
+     * NUNCHUCK_BACKOFF_MAX_MS.
+     */
+    idle = idle_timeout_ms && !nunchuck_capturing(nunchuck) &&
+        time_after(jiffies, nunchuck->last_active +
+                msecs_to_jiffies(idle_timeout_ms));
+    period_ms = idle ? max(idle_sleep_ms, sleep_ms) : sleep_ms;
+    if (nunchuck->errors)
+        period_ms = max_t(u64, period_ms,
+                min_t(u64, (u64) sleep_ms << min(nunchuck->errors, 16U),
+                    NUNCHUCK_BACKOFF_MAX_MS));
+    WRITE_ONCE(nunchuck->sleep_ms, period_ms);
+
+    if (nunchuck->idle && !idle && !READ_ONCE(nunchuck->stopping))
+        hrtimer_start(&nunchuck->timer, nunchuck_period(sleep_ms),
+                HRTIMER_MODE_REL);
+    nunchuck->idle = idle;
+}
+
+static enum hrtimer_restart nunchuck_timer(struct hrtimer* timer)
+{
+    struct nunchuck_dev* nunchuck =
+        container_of(timer, struct nunchuck_dev, timer);
+
+    u64 overruns;
+
+    if (READ_ONCE(nunchuck->stopping))
+        return HRTIMER_NORESTART;
+
+    WRITE_ONCE(nunchuck->fired, ktime_get());
+    queue_work(system_highpri_wq, &nunchuck->work);
+    overruns = hrtimer_forward_now(timer,
+            nunchuck_period(READ_ONCE(nunchuck->sleep_ms)));
+    if (overruns > 1)
+        nunchuck->stats.missed_periods += overruns - 1;
+    return HRTIMER_RESTART;
 }
 
+/* the device id argument went away in 6.3 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static int nunchuck_probe(struct i2c_client* client)
+#else
 static int nunchuck_probe(struct i2c_client* client,
         const struct i2c_device_id* id)
+#endif
 {
     struct nunchuck_dev *nunchuck = NULL;
     struct input_dev *input = NULL;
+    struct input_dev *accel = NULL;
     int result;
-    char init1[] = {0xf0, 0x55};
-    char init2[] = {0xfb, 0x00};
 
-    dump_stack();
+    DUMP_STACK();
     printk(KERN_INFO "[%s] FUNC: %s, LINE: %d: Hello nunchuck!\n",
             DRIVER_NAME, __func__, __LINE__);
 
     nunchuck = devm_kzalloc(&client->dev, sizeof(struct nunchuck_dev),
             GFP_KERNEL);
 
-    nunchuck->i2c_client = client;
-    i2c_set_clientdata(client, nunchuck);
-
     if (!nunchuck) {
         printk(KERN_INFO "[%s] FUNC: %s, LINE: %d:"
                 " malloc struct nunchuck_dev failed\n",
@@ -278,6 +1215,10 @@ static int nunchuck_probe(struct i2c_client* client,
         return -ENOMEM;
     }
 
+    nunchuck->i2c_client = client;
+    nunchuck_params_init(&nunchuck->params);
+    i2c_set_clientdata(client, nunchuck);
+
     input = input_allocate_device();
     if (!input) {
         printk(KERN_INFO "[%s] FUNC: %s, LINE: %d:"
@@ -301,51 +1242,125 @@ static int nunchuck_probe(struct i2c_client* client,
     __set_bit(INPUT_PROP_POINTING_STICK, input->propbit);
     nunchuck->input_dev = input;
 
-    result = input_register_device(nunchuck->input_dev);
+    accel = input_allocate_device();
+    if (!accel) {
+        printk(KERN_INFO "[%s] FUNC: %s, LINE: %d:"
+                " allocate accelerometer input device failed\n",
+            DRIVER_NAME, __func__, __LINE__);
+        result = -ENOMEM;
+        goto register_err;
+    }
+
+    accel->name = DRIVER_NAME " accelerometer";
+    accel->id = input->id;
+    accel->dev.parent = &client->dev;
+    input_set_abs_params(accel, ABS_X, 0, NUNCHUCK_ACCEL_MAX,
+            NUNCHUCK_ACCEL_FUZZ, 0);
+    input_set_abs_params(accel, ABS_Y, 0, NUNCHUCK_ACCEL_MAX,
+            NUNCHUCK_ACCEL_FUZZ, 0);
+    input_set_abs_params(accel, ABS_Z, 0, NUNCHUCK_ACCEL_MAX,
+            NUNCHUCK_ACCEL_FUZZ, 0);
+    __set_bit(INPUT_PROP_ACCELEROMETER, accel->propbit);
+    nunchuck->accel_dev = accel;
+
+    result = input_register_device(input);
     if (result < 0)
         goto register_err;
 
-    mutex_init(&params.lock);
+    result = input_register_device(accel);
+    if (result < 0)
+        goto accel_register_err;
+
+    result = nunchuck_ring_init(nunchuck, &client->dev);
+    if (result)
+        goto ring_error;
+
     result = sysfs_create_files(&client->dev.kobj, nunparam_attrs);
     if (result)
         goto create_file_error;
 
-    result = nunchuck_write_registers(client, init1, sizeof(init1));
-    if (result < 0)
-        goto write_error;
-    result = nunchuck_write_registers(client, init2, sizeof(init2));
+    result = misc_register(&nunchuck->raw_misc);
+    if (result)
+        goto misc_error;
+
+    result = nunchuck_iio_init(nunchuck, &client->dev);
+    if (result)
+        goto iio_error;
+
+    result = nunchuck_init_sequence(client);
     if (result < 0)
         goto write_error;
 
-    nunchuck_tsk = kthread_run(nunchuck_thread,
-            nunchuck, "nunchuck_thread");
+    nunchuck->debugfs = debugfs_create_dir(dev_name(&client->dev),
+            nunchuck_debugfs_root);
+    debugfs_create_file("stats", S_IRUSR, nunchuck->debugfs, nunchuck,
+            &nunchuck_stats_fops);
+
+    INIT_WORK(&nunchuck->work, nunchuck_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&nunchuck->timer, nunchuck_timer, CLOCK_MONOTONIC,
+            HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&nunchuck->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nunchuck->timer.function = nunchuck_timer;
+#endif
+    nunchuck->sleep_ms = atomic_read(&nunchuck->params.thread_sleep_ms);
+    nunchuck->last_active = jiffies;
+    hrtimer_start(&nunchuck->timer, nunchuck_period(nunchuck->sleep_ms),
+            HRTIMER_MODE_REL);
 
     return 0;
 
 
 write_error:
+    nunchuck_iio_remove(nunchuck);
+iio_error:
+    misc_deregister(&nunchuck->raw_misc);
+misc_error:
     sysfs_remove_files(&client->dev.kobj, nunparam_attrs);
 create_file_error:
-    input_unregister_device(nunchuck->input_dev);
+    nunchuck_ring_remove(nunchuck);
+ring_error:
+    /* unregistering drops the last reference, nothing left to free */
+    input_unregister_device(accel);
+    accel = NULL;
+accel_register_err:
+    input_unregister_device(input);
+    input = NULL;
 register_err:
-    input_free_device(nunchuck->input_dev);
-    return -ENOMEM;
+    input_free_device(accel);
+    input_free_device(input);
+    return result;
 }
 
+/* remove() returns void since 6.1 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+static void nunchuck_remove(struct i2c_client* client)
+#else
 static int nunchuck_remove(struct i2c_client* client)
+#endif
 {
     struct nunchuck_dev *nunchuck = i2c_get_clientdata(client);
-    struct input_dev* input = nunchuck->input_dev;
-    dump_stack();
+    DUMP_STACK();
     printk(KERN_INFO "[%s] FUNC: %s, LINE: %d: Goodbye nunchuck!\n",
             DRIVER_NAME, __func__, __LINE__);
 
-    kthread_stop(nunchuck_tsk);
+    /* the work may restart the timer until it sees stopping */
+    WRITE_ONCE(nunchuck->stopping, true);
+    hrtimer_cancel(&nunchuck->timer);
+    cancel_work_sync(&nunchuck->work);
+    hrtimer_cancel(&nunchuck->timer);
+    debugfs_remove_recursive(nunchuck->debugfs);
+    nunchuck_iio_remove(nunchuck);
+    misc_deregister(&nunchuck->raw_misc);
     sysfs_remove_files(&client->dev.kobj, nunparam_attrs);
-    input_unregister_device(input);
-    input_free_device(input);
+    nunchuck_ring_remove(nunchuck);
+    input_unregister_device(nunchuck->accel_dev);
+    input_unregister_device(nunchuck->input_dev);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
     return 0;
+#endif
 }
 
 static const struct of_device_id nunchuck_dt_ids[] = {
@@ -370,6 +1385,24 @@ static struct i2c_driver nunckuck_driver = {
         .of_match_table = of_match_ptr(nunchuck_dt_ids),
     },
 };
-module_i2c_driver(nunckuck_driver);
+static int __init nunchuck_init(void)
+{
+    int result;
+
+    nunchuck_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+    result = i2c_add_driver(&nunckuck_driver);
+    if (result)
+        debugfs_remove_recursive(nunchuck_debugfs_root);
+    return result;
+}
+
+static void __exit nunchuck_exit(void)
+{
+    i2c_del_driver(&nunckuck_driver);
+    debugfs_remove_recursive(nunchuck_debugfs_root);
+}
+
+module_init(nunchuck_init);
+module_exit(nunchuck_exit);
 
 MODULE_LICENSE("Dual BSD/GPL");
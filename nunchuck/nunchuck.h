@@ -0,0 +1,42 @@
+#ifndef NUNCHUCK_H
+#define NUNCHUCK_H
+
+#include <linux/types.h>
+
+#ifndef NUNCHUCK_RING_SAMPLES
+#define NUNCHUCK_RING_SAMPLES 4096
+#endif /* NUNCHUCK_RING_SAMPLES */
+
+/*
+ * Raw sample, as queued on /dev/nunchuck-raw-<i2c device> by every poll
+ */
+struct nunchuck_sample {
+    __u64 ts_ns;        /* CLOCK_MONOTONIC, when the frame was read */
+    __s16 jx;           /* joystick, -128..127 around the center */
+    __s16 jy;
+    __u16 ax;           /* accelerometer, 0..1023 */
+    __u16 ay;
+    __u16 az;
+    __u16 buttons;      /* NUNCHUCK_BTN_* */
+    __u32 seq;          /* counts every sample, including dropped ones */
+};
+
+#define NUNCHUCK_BTN_Z 0x1
+#define NUNCHUCK_BTN_C 0x2
+
+/*
+ * Layout of the mmap()ed ring. The driver only advances head and the
+ * consumer only advances tail, both counting samples modulo 2^32; sample
+ * n lives at samples[n & (size - 1)]. When the ring is full new samples
+ * are dropped and counted.
+ */
+struct nunchuck_ring {
+    __u32 head;
+    __u32 tail;
+    __u32 size;         /* power of two */
+    __u32 dropped;      /* copy of the driver's count, see sysfs dropped */
+    __u32 reserved[12];
+    struct nunchuck_sample samples[];
+};
+
+#endif /* NUNCHUCK_H */
@@ -0,0 +1,295 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+/*
+ * Emulated nunchuck on a virtual I2C adapter, so nunchuck.c can be driven
+ * without hardware. Frames written to debugfs "frames" (six hex bytes per
+ * frame) are served in a loop, one per conversion request; "served" logs
+ * when each frame was read, for latency measurements.
+ */
+
+#define DRIVER_NAME "nunchuck_emu"
+#define EMU_ADDR 0x52
+#define EMU_MAX_FRAMES 1024
+#define EMU_LOG 4096
+#define EMU_FRAME 6
+
+struct emu_served {
+    u64 ts_ns;          /* CLOCK_MONOTONIC */
+    u32 seq;
+    u8 frame[EMU_FRAME];
+};
+
+struct nunchuck_emu {
+    struct mutex lock;
+    u8 (*frames)[EMU_FRAME];
+    unsigned int nr_frames;
+    unsigned int next;
+    u8 latched[EMU_FRAME];
+    bool initialised;
+    u32 seq;
+    struct emu_served *log;
+    struct dentry *debugfs;
+    struct i2c_client *client;
+};
+
+static struct nunchuck_emu emu;
+
+/* centered joystick, accelerometer at 512, no button pressed */
+static const u8 emu_idle_frame[EMU_FRAME] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x03,
+};
+
+static void emu_write(const struct i2c_msg* m)
+{
+    if (m->len == 2 && m->buf[0] == 0xfb && m->buf[1] == 0x00) {
+        emu.initialised = true;
+    } else if (m->len == 1 && m->buf[0] == 0x00) {
+        /* conversion request: latch the next scripted frame */
+        if (emu.nr_frames) {
+            memcpy(emu.latched, emu.frames[emu.next], EMU_FRAME);
+            emu.next = (emu.next + 1) % emu.nr_frames;
+        } else {
+            memcpy(emu.latched, emu_idle_frame, EMU_FRAME);
+        }
+    }
+}
+
+static void emu_read(struct i2c_msg* m)
+{
+    struct emu_served *served;
+
+    if (!emu.initialised) {
+        memset(m->buf, 0xff, m->len);
+        return;
+    }
+
+    memset(m->buf, 0, m->len);
+    memcpy(m->buf, emu.latched, min_t(u16, m->len, EMU_FRAME));
+
+    served = &emu.log[emu.seq % EMU_LOG];
+    served->ts_ns = ktime_get_ns();
+    served->seq = emu.seq++;
+    memcpy(served->frame, emu.latched, EMU_FRAME);
+}
+
+static int emu_xfer(struct i2c_adapter* adap, struct i2c_msg* msgs, int num)
+{
+    int i;
+
+    mutex_lock(&emu.lock);
+    for (i = 0; i < num; i++) {
+        if (msgs[i].addr != EMU_ADDR)
+            break;
+        if (msgs[i].flags & I2C_M_RD)
+            emu_read(&msgs[i]);
+        else
+            emu_write(&msgs[i]);
+    }
+    mutex_unlock(&emu.lock);
+
+    return i == num ? num : -ENXIO;
+}
+
+static u32 emu_functionality(struct i2c_adapter* adap)
+{
+    return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
+}
+
+static const struct i2c_algorithm emu_algo = {
+    /* master_xfer was renamed in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+    .xfer = emu_xfer,
+#else
+    .master_xfer = emu_xfer,
+#endif
+    .functionality = emu_functionality,
+};
+
+static struct i2c_adapter emu_adapter = {
+    .owner = THIS_MODULE,
+    .algo = &emu_algo,
+    .name = "nunchuck emulator",
+};
+
+static int emu_frames_show(struct seq_file* s, void* v)
+{
+    unsigned int i;
+
+    mutex_lock(&emu.lock);
+    for (i = 0; i < emu.nr_frames; i++)
+        seq_printf(s, "%*phN\n", EMU_FRAME, emu.frames[i]);
+    mutex_unlock(&emu.lock);
+    return 0;
+}
+
+static int emu_frames_open(struct inode* inode, struct file* file)
+{
+    return single_open(file, emu_frames_show, NULL);
+}
+
+/*
+ * Replace the script with whitespace separated hex bytes, six per frame.
+ */
+static ssize_t emu_frames_write(struct file* file, const char __user *ubuf,
+        size_t count, loff_t *ppos)
+{
+    u8 (*frames)[EMU_FRAME];
+    char *buf, *cur, *tok;
+    unsigned int n = 0;
+    int err = 0;
+
+    buf = memdup_user_nul(ubuf, count);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    frames = kcalloc(EMU_MAX_FRAMES, EMU_FRAME, GFP_KERNEL);
+    if (!frames) {
+        kfree(buf);
+        return -ENOMEM;
+    }
+
+    cur = buf;
+    while ((tok = strsep(&cur, " \t\n")) != NULL) {
+        if (!*tok)
+            continue;
+        if (n >= EMU_MAX_FRAMES * EMU_FRAME ||
+                kstrtou8(tok, 16, &frames[n / EMU_FRAME][n % EMU_FRAME])) {
+            err = -EINVAL;
+            break;
+        }
+        n++;
+    }
+    kfree(buf);
+
+    if (!err && n % EMU_FRAME)
+        err = -EINVAL;
+    if (err) {
+        kfree(frames);
+        return err;
+    }
+
+    mutex_lock(&emu.lock);
+    kfree(emu.frames);
+    emu.frames = frames;
+    emu.nr_frames = n / EMU_FRAME;
+    emu.next = 0;
+    mutex_unlock(&emu.lock);
+
+    return count;
+}
+
+static const struct file_operations emu_frames_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_frames_open,
+    .read = seq_read,
+    .write = emu_frames_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * One line per served frame, oldest first: seq, timestamp in ns, frame
+ */
+static int emu_served_show(struct seq_file* s, void* v)
+{
+    u32 seq, first;
+
+    mutex_lock(&emu.lock);
+    first = emu.seq > EMU_LOG ? emu.seq - EMU_LOG : 0;
+    for (seq = first; seq != emu.seq; seq++) {
+        struct emu_served *served = &emu.log[seq % EMU_LOG];
+        seq_printf(s, "%u %llu %*phN\n", served->seq, served->ts_ns,
+                EMU_FRAME, served->frame);
+    }
+    mutex_unlock(&emu.lock);
+    return 0;
+}
+
+static int emu_served_open(struct inode* inode, struct file* file)
+{
+    return single_open_size(file, emu_served_show, NULL,
+            EMU_LOG * 48);
+}
+
+static const struct file_operations emu_served_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_served_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int __init nunchuck_emu_init(void)
+{
+    struct i2c_board_info info = {
+        I2C_BOARD_INFO("nunchuck", EMU_ADDR),
+    };
+    int result;
+
+    mutex_init(&emu.lock);
+    memcpy(emu.latched, emu_idle_frame, EMU_FRAME);
+
+    emu.log = kcalloc(EMU_LOG, sizeof(struct emu_served), GFP_KERNEL);
+    if (!emu.log)
+        return -ENOMEM;
+
+    result = i2c_add_adapter(&emu_adapter);
+    if (result)
+        goto adapter_error;
+
+    emu.debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+    debugfs_create_file("frames", S_IRUSR | S_IWUSR, emu.debugfs, NULL,
+            &emu_frames_fops);
+    debugfs_create_file("served", S_IRUSR, emu.debugfs, NULL,
+            &emu_served_fops);
+
+    /* i2c_new_device() was replaced in 5.5 and is gone since 5.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    emu.client = i2c_new_client_device(&emu_adapter, &info);
+    if (IS_ERR(emu.client)) {
+        result = PTR_ERR(emu.client);
+        goto client_error;
+    }
+#else
+    emu.client = i2c_new_device(&emu_adapter, &info);
+    if (!emu.client) {
+        result = -ENODEV;
+        goto client_error;
+    }
+#endif
+
+    printk(KERN_INFO "[%s] emulated nunchuck on %s\n", DRIVER_NAME,
+            dev_name(&emu_adapter.dev));
+    return 0;
+
+client_error:
+    debugfs_remove_recursive(emu.debugfs);
+    i2c_del_adapter(&emu_adapter);
+adapter_error:
+    kfree(emu.log);
+    return result;
+}
+
+static void __exit nunchuck_emu_exit(void)
+{
+    i2c_unregister_device(emu.client);
+    debugfs_remove_recursive(emu.debugfs);
+    i2c_del_adapter(&emu_adapter);
+    kfree(emu.frames);
+    kfree(emu.log);
+}
+
+module_init(nunchuck_emu_init);
+module_exit(nunchuck_emu_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
@@ -0,0 +1,87 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nunchuck
+
+#if !defined(NUNCHUCK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define NUNCHUCK_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* 6.10 takes the source from the matching __string() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define nunchuck_assign_name(dev) __assign_str(name)
+#else
+#define nunchuck_assign_name(dev) __assign_str(name, dev_name(dev))
+#endif
+
+/*
+ * One event per stage of the sampling pipeline, carrying its duration
+ */
+DECLARE_EVENT_CLASS(nunchuck_stage,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(dev))
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        nunchuck_assign_name(dev);
+        __entry->ns = ns;
+    ),
+
+    TP_printk("%s %llu ns", __get_str(name),
+        (unsigned long long) __entry->ns)
+);
+
+/* timer expiry to the start of the work */
+DEFINE_EVENT(nunchuck_stage, nunchuck_sched,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns));
+
+/* conversion request to the read of its result */
+DEFINE_EVENT(nunchuck_stage, nunchuck_wait,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns));
+
+/* the combined read + request bus transfer */
+DEFINE_EVENT(nunchuck_stage, nunchuck_xfer,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns));
+
+/* decode and filter */
+DEFINE_EVENT(nunchuck_stage, nunchuck_parse,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns));
+
+/* input, IIO and raw ring delivery */
+DEFINE_EVENT(nunchuck_stage, nunchuck_report,
+    TP_PROTO(struct device *dev, u64 ns),
+    TP_ARGS(dev, ns));
+
+TRACE_EVENT(nunchuck_bus_error,
+    TP_PROTO(struct device *dev, int status),
+    TP_ARGS(dev, status),
+
+    TP_STRUCT__entry(
+        __string(name, dev_name(dev))
+        __field(int, status)
+    ),
+
+    TP_fast_assign(
+        nunchuck_assign_name(dev);
+        __entry->status = status;
+    ),
+
+    TP_printk("%s status %d", __get_str(name), __entry->status)
+);
+
+#endif /* NUNCHUCK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nunchuck_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,115 @@
+import glob
+import mmap
+import os
+import select
+import struct
+import sys
+import time
+
+# Drains /dev/nunchuck-raw-* and reports the sample rate, ring drops and
+# sequence gaps, and the frame-read to consumer latency. Run as root with
+# nunchuck.ko bound to a controller; loading nunchuck_emu.ko provides one
+# without hardware. The consumer is read() by default, "mmap" as the first
+# argument walks the shared ring instead.
+
+sleep_ms = 1
+duration = 5.0
+
+header_format = '=IIII'         # head, tail, size, dropped
+header_size = 64                # struct nunchuck_ring up to samples[]
+sample_format = '=QhhHHHHI'     # struct nunchuck_sample
+sample_size = struct.calcsize(sample_format)
+
+
+def drain_read(fd, samples):
+    select.select([fd], [], [], 0.1)
+    try:
+        data = os.read(fd, sample_size * 256)
+    except BlockingIOError:
+        return
+    now = time.monotonic_ns()
+    for off in range(0, len(data), sample_size):
+        ts, _, _, _, _, _, _, seq = struct.unpack_from(sample_format,
+                                                       data, off)
+        samples.append((now, ts, seq))
+
+
+def drain_mmap(ring, samples):
+    # x86 keeps the loads ordered; other CPUs would need barriers here
+    head, tail, size, _ = struct.unpack_from(header_format, ring, 0)
+    if head == tail:
+        time.sleep(sleep_ms / 4000.0)
+        return
+    now = time.monotonic_ns()
+    while tail != head:
+        off = header_size + (tail & (size - 1)) * sample_size
+        ts, _, _, _, _, _, _, seq = struct.unpack_from(sample_format,
+                                                       ring, off)
+        samples.append((now, ts, seq))
+        tail = (tail + 1) & 0xffffffff
+    struct.pack_into('=I', ring, 4, tail)
+
+
+def dropped():
+    total = 0
+    for path in glob.glob('/sys/bus/i2c/drivers/nunchuck/*/dropped'):
+        with open(path) as f:
+            total += int(f.read())
+    return total
+
+
+if __name__ == '__main__':
+    use_mmap = len(sys.argv) > 1 and sys.argv[1] == 'mmap'
+    nodes = glob.glob('/dev/nunchuck-raw-*')
+    if not nodes:
+        print("no nunchuck raw device")
+        exit(1)
+
+    for path in glob.glob('/sys/bus/i2c/drivers/nunchuck/*/sleep_ms'):
+        with open(path, 'w') as f:
+            f.write(str(sleep_ms))
+
+    # the mmap consumer writes tail, so it needs a writable mapping
+    fd = os.open(nodes[0], (os.O_RDWR if use_mmap else os.O_RDONLY) |
+                 os.O_NONBLOCK)
+    ring = None
+    if use_mmap:
+        # map the header first to learn the ring size
+        hdr = mmap.mmap(fd, mmap.PAGESIZE)
+        size = struct.unpack_from(header_format, hdr, 0)[2]
+        hdr.close()
+        length = header_size + size * sample_size
+        length = (length + mmap.PAGESIZE - 1) & ~(mmap.PAGESIZE - 1)
+        ring = mmap.mmap(fd, length)
+
+    samples = []
+    dropped_before = dropped()
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        if use_mmap:
+            drain_mmap(ring, samples)
+        else:
+            drain_read(fd, samples)
+    dropped_during = dropped() - dropped_before
+
+    if ring:
+        ring.close()
+    os.close(fd)
+
+    if len(samples) < 2:
+        print("no samples")
+        exit(1)
+
+    span = (samples[-1][1] - samples[0][1]) / 1e9
+    gaps = sum(1 for a, b in zip(samples, samples[1:])
+               if (b[2] - a[2]) & 0xffffffff != 1)
+    latencies = sorted(now - ts for now, ts, _ in samples)
+    print("%s: %d samples, %.1f samples/s (period %d ms)" %
+          ('mmap' if use_mmap else 'read', len(samples),
+           (len(samples) - 1) / span if span else 0, sleep_ms))
+    print("dropped %d, sequence gaps %d" % (dropped_during, gaps))
+    print("latency us: min %.1f median %.1f p99 %.1f max %.1f" %
+          (latencies[0] / 1e3,
+           latencies[len(latencies) // 2] / 1e3,
+           latencies[len(latencies) * 99 // 100] / 1e3,
+           latencies[-1] / 1e3))
@@ -0,0 +1,161 @@
+/*
+ * Bulk copy cost of a default scull device: for 1 MB and 16 MB buffers,
+ * times writing the buffer to the device and reading it back, once with a
+ * single call (the pinned-page path, at or above SCULL_DIO_THRESHOLD) and
+ * once in calls just below the threshold (one quantum per call), and
+ * reports ns and CPU cycles per byte. Cycles come from a perf counter and
+ * cover user and kernel time; they are left out if perf is not available.
+ * Run as root with scull.ko loaded; "make bench" builds it.
+ *
+ *     dio_bench [seconds]    default 2 per measurement
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "scull.h"
+
+static int cycles_fd = -1;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void open_cycles(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+    };
+
+    cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cycles_fd < 0)
+        perror("perf_event_open, reporting time only");
+}
+
+static uint64_t read_cycles(void)
+{
+    uint64_t n = 0;
+
+    if (cycles_fd >= 0 && read(cycles_fd, &n, sizeof(n)) != sizeof(n))
+        n = 0;
+    return n;
+}
+
+/*
+ * Move size bytes between buf and the start of the device in calls of at
+ * most step bytes; returns 0 or -1 on a short or failed call.
+ */
+static int xfer(int fd, char* buf, size_t size, size_t step, int write)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < size) {
+        size_t len = size - done < step ? size - done : step;
+
+        if (write)
+            n = pwrite(fd, buf + done, len, done);
+        else
+            n = pread(fd, buf + done, len, done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int measure(int fd, char* buf, size_t size, size_t step, int write,
+        double seconds)
+{
+    double start, elapsed, end;
+    uint64_t cycles;
+    unsigned long n;
+    double bytes;
+
+    start = now();
+    end = start + seconds;
+    cycles = read_cycles();
+    for (n = 0; !n || now() < end; n++)
+        if (xfer(fd, buf, size, step, write)) {
+            perror(write ? "write" : "read");
+            return -1;
+        }
+    cycles = read_cycles() - cycles;
+    elapsed = now() - start;
+    bytes = (double) n * size;
+
+    printf("%5zu MB %-5s %-8s %7.3f ns/byte", size >> 20,
+            write ? "write" : "read",
+            step == size ? "pinned" : "quantum", elapsed * 1e9 / bytes);
+    if (cycles_fd >= 0)
+        printf(" %7.3f cycles/byte", cycles / bytes);
+    printf("\n");
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t sizes[] = { 1 << 20, 16 << 20 };
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 2;
+    struct scull_geometry geo = { 0 };
+    int ctl, fd, ret = 1;
+    char *buf, *check;
+    unsigned int i;
+    char path[32];
+    size_t j;
+
+    ctl = open("/dev/scull-control", O_RDWR);
+    if (ctl < 0 || ioctl(ctl, SCULL_IOCCREATE, &geo)) {
+        perror("scull-control");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/dev/scull%d", geo.index);
+    fd = open(path, O_RDWR);
+    buf = malloc(sizes[1]);
+    check = malloc(sizes[1]);
+    if (fd < 0 || !buf || !check) {
+        perror(path);
+        goto out;
+    }
+    for (j = 0; j < sizes[1]; j++)
+        buf[j] = j * 7;
+    open_cycles();
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+
+        if (measure(fd, buf, size, SCULL_DIO_THRESHOLD - 1, 1, seconds) ||
+                measure(fd, buf, size, size, 1, seconds) ||
+                measure(fd, check, size, SCULL_DIO_THRESHOLD - 1, 0,
+                    seconds) ||
+                measure(fd, check, size, size, 0, seconds))
+            goto out;
+        if (memcmp(buf, check, size)) {
+            fprintf(stderr, "%zu MB: read back differs\n", size >> 20);
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    free(check);
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    ioctl(ctl, SCULL_IOCDESTROY, geo.index);
+    close(ctl);
+    return ret;
+}
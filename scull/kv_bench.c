@@ -0,0 +1,170 @@
+/*
+ * Lookup throughput of a SCULL_DEV_KV device: creates a device through
+ * /dev/scull-control, PUTs nr_keys keys, rewrites them all a few times to
+ * show that the device stays bounded by compaction, then times random
+ * single GETs and batched MGETs. Run as root with scull.ko loaded;
+ * "make bench" builds it.
+ *
+ *     kv_bench [nr_keys [seconds [batch]]]    defaults 1000000 5 64
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "scull.h"
+
+#define KEY_LEN 16
+#define VAL_LEN 8
+#define REWRITES 4
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char* key, unsigned int n)
+{
+    snprintf(key, KEY_LEN + 1, "key-%012u", n);
+}
+
+static int put_all(int fd, unsigned int nr_keys)
+{
+    char key[KEY_LEN + 1], val[VAL_LEN];
+    struct scull_kv kv;
+    unsigned int i;
+
+    for (i = 0; i < nr_keys; i++) {
+        make_key(key, i);
+        memcpy(val, &i, sizeof(i));
+        kv = (struct scull_kv) {
+            .key = key, .key_len = KEY_LEN,
+            .val = val, .val_len = VAL_LEN,
+        };
+        if (ioctl(fd, SCULL_IOCKVPUT, &kv)) {
+            perror("SCULL_IOCKVPUT");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int nr_keys = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    double seconds = argc > 2 ? strtod(argv[2], NULL) : 5;
+    unsigned int batch = argc > 3 ? strtoul(argv[3], NULL, 0) : 64;
+    struct scull_geometry geo = { .flags = SCULL_DEV_KV };
+    struct scull_kv_batch mget;
+    struct scull_kv kv, *ops;
+    char (*keys)[KEY_LEN + 1];
+    char (*vals)[VAL_LEN];
+    char val[VAL_LEN], path[32];
+    unsigned long long n;
+    double start, end;
+    int ctl, fd, ret = 1;
+    unsigned int i;
+
+    if (!nr_keys || !batch || batch > SCULL_KV_MAX_BATCH) {
+        fprintf(stderr, "usage: %s [nr_keys [seconds [batch <= %d]]]\n",
+                argv[0], SCULL_KV_MAX_BATCH);
+        return 1;
+    }
+
+    /* about one key per bucket */
+    for (geo.kv_bits = 1; geo.kv_bits < SCULL_KV_MAX_BITS &&
+            (1U << geo.kv_bits) < nr_keys; geo.kv_bits++)
+        ;
+
+    ctl = open("/dev/scull-control", O_RDWR);
+    if (ctl < 0 || ioctl(ctl, SCULL_IOCCREATE, &geo)) {
+        perror("scull-control");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/dev/scull%d", geo.index);
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        goto destroy;
+    }
+
+    keys = malloc(sizeof(*keys) * batch);
+    vals = malloc(sizeof(*vals) * batch);
+    ops = calloc(batch, sizeof(*ops));
+    if (!keys || !vals || !ops)
+        goto out;
+
+    start = now();
+    if (put_all(fd, nr_keys))
+        goto out;
+    printf("put: %u keys in %.2f s, kv_bits %d\n", nr_keys, now() - start,
+            geo.kv_bits);
+
+    start = now();
+    for (i = 0; i < REWRITES; i++)
+        if (put_all(fd, nr_keys))
+            goto out;
+    printf("rewrite: %u x %u keys in %.2f s, device %lld bytes for %llu "
+            "live\n", REWRITES, nr_keys, now() - start,
+            (long long) lseek(fd, 0, SEEK_END),
+            (unsigned long long) nr_keys * VAL_LEN);
+
+    start = now();
+    end = start + seconds;
+    for (n = 0; (n & 1023) || now() < end; n++) {
+        unsigned int k = random() % nr_keys;
+
+        make_key(keys[0], k);
+        kv = (struct scull_kv) {
+            .key = keys[0], .key_len = KEY_LEN,
+            .val = val, .val_len = VAL_LEN,
+        };
+        if (ioctl(fd, SCULL_IOCKVGET, &kv) || memcmp(val, &k, sizeof(k))) {
+            fprintf(stderr, "get: bad value for key %u\n", k);
+            goto out;
+        }
+    }
+    printf("get: %.0f lookups/s\n", n / (now() - start));
+
+    mget.ops = ops;
+    mget.nr = batch;
+    start = now();
+    end = start + seconds;
+    for (n = 0; now() < end; n += batch) {
+        for (i = 0; i < batch; i++) {
+            make_key(keys[i], random() % nr_keys);
+            ops[i] = (struct scull_kv) {
+                .key = keys[i], .key_len = KEY_LEN,
+                .val = vals[i], .val_len = VAL_LEN,
+            };
+        }
+        if (ioctl(fd, SCULL_IOCKVMGET, &mget)) {
+            perror("SCULL_IOCKVMGET");
+            goto out;
+        }
+        for (i = 0; i < batch; i++)
+            if (ops[i].result) {
+                fprintf(stderr, "mget: entry %u failed: %d\n", i,
+                        ops[i].result);
+                goto out;
+            }
+    }
+    printf("mget x%u: %.0f lookups/s\n", batch, n / (now() - start));
+    ret = 0;
+
+out:
+    free(keys);
+    free(vals);
+    free(ops);
+    close(fd);
+destroy:
+    ioctl(ctl, SCULL_IOCDESTROY, geo.index);
+    close(ctl);
+    return ret;
+}
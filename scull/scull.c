@@ -13,15 +13,135 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/sched.h>
+#include <linux/mmu_context.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/jhash.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/kthread.h>
+#endif
 
 #include "scull.h"
 
+/*
+ * Interfaces that changed after 4.9, the kernel this driver was written
+ * for. The rest of the file only uses the names below.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define scull_access_ok(type, addr, size) access_ok(addr, size)
+#else
+#define scull_access_ok(type, addr, size) access_ok(type, addr, size)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define scull_use_mm(mm) kthread_use_mm(mm)
+#define scull_unuse_mm(mm) kthread_unuse_mm(mm)
+#else
+#define scull_use_mm(mm) use_mm(mm)
+#define scull_unuse_mm(mm) unuse_mm(mm)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define scull_class_create(name) class_create(name)
+#else
+#define scull_class_create(name) class_create(THIS_MODULE, name)
+#endif
+
+/*
+ * Pin the user pages at addr for the duration of a copy; user_write if the
+ * copy writes into them.
+ */
+static int scull_pin_pages(unsigned long addr, int nr_pages, int user_write,
+        struct page** pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    return pin_user_pages_fast(addr, nr_pages, user_write ? FOLL_WRITE : 0,
+            pages);
+#else
+    return get_user_pages_fast(addr, nr_pages, user_write, pages);
+#endif
+}
+
+static void scull_unpin_pages(struct page** pages, int nr_pages, int dirty)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+    unpin_user_pages_dirty_lock(pages, nr_pages, dirty);
+#else
+    int i;
+
+    for (i = 0; i < nr_pages; i++) {
+        if (dirty)
+            set_page_dirty_lock(pages[i]);
+        put_page(pages[i]);
+    }
+#endif
+}
+
+/*
+ * import_single_range(), which is gone from current kernels, built on
+ * iov_iter_init(), which is not.
+ */
+static int scull_import(int rw, void __user *buf, size_t len,
+        struct iovec* iov, struct iov_iter* iter)
+{
+    if (len > MAX_RW_COUNT)
+        len = MAX_RW_COUNT;
+    if (!scull_access_ok(rw == READ ? VERIFY_WRITE : VERIFY_READ, buf, len))
+        return -EFAULT;
+
+    iov->iov_base = buf;
+    iov->iov_len = len;
+    iov_iter_init(iter, rw, iov, 1, len);
+    return 0;
+}
+
+/*
+ * dup_iter(), which does not take ITER_UBUF (6.0) iterators: a single user
+ * buffer has no segment array and is copied as it is. *iov is what to free
+ * once the copy is done with.
+ */
+static int scull_dup_iter(struct iov_iter* new, struct iov_iter* old,
+        const void** iov)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    if (iter_is_ubuf(old)) {
+        *new = *old;
+        *iov = NULL;
+        return 0;
+    }
+#endif
+    *iov = dup_iter(new, old, GFP_KERNEL);
+    return *iov ? 0 : -ENOMEM;
+}
+
+/* user memory behind iter, ITER_UBUF (6.0) included */
+static inline bool scull_user_iter(const struct iov_iter* iter)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return user_backed_iter(iter);
+#else
+    return iter_is_iovec(iter);
+#endif
+}
+
 int scull_major = SCULL_MAJOR;
 int scull_minor = 0;
 int scull_nr_devs = SCULL_NR_DEVS;
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset = SCULL_QSET;
 struct class* scull_class = NULL;
+static struct workqueue_struct *scull_aio_wq;
 
 #define SCULL_NAME "scull"
 
@@ -31,7 +151,42 @@ module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
 
-struct scull_dev* scull_devices;
+/*
+ * Devices are looked up by index (minor - scull_minor) in scull_idr.
+ * scull_idr_lock serialises creation, destruction and lookups on open.
+ */
+static DEFINE_IDR(scull_idr);
+static DEFINE_MUTEX(scull_idr_lock);
+static struct cdev scull_ctl_cdev;
+
+/*
+ * Key index of SCULL_DEV_KV devices: each key maps to the (offset, length)
+ * of its latest value within the device's quantum storage.
+ */
+struct scull_kv_entry {
+    struct hlist_node node;
+    u32 hash;
+    u32 len;
+    loff_t off;
+    u16 key_len;
+    u8 key[];
+};
+
+static void scull_kv_clear(struct scull_dev* dev)
+{
+    struct scull_kv_entry *e;
+    struct hlist_node *tmp;
+    int i;
+
+    if (!dev->kv_table)
+        return;
+
+    for (i = 0; i < (1 << dev->kv_bits); i++)
+        hlist_for_each_entry_safe(e, tmp, &dev->kv_table[i], node) {
+            hlist_del(&e->node);
+            kfree(e);
+        }
+}
 
 static int scull_trim(struct scull_dev* dev)
 {
@@ -52,20 +207,38 @@ static int scull_trim(struct scull_dev* dev)
         kfree(ptr);
     }
 
+    scull_kv_clear(dev);
+
+    dev->kv_dead = 0;
     dev->size = 0;
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
+    dev->quantum = dev->def_quantum ? dev->def_quantum : scull_quantum;
+    dev->qset = dev->def_qset ? dev->def_qset : scull_qset;
     dev->data = NULL;
 
     return 0;
 }
 
-struct scull_qset* scull_follow(struct scull_dev* dev, int n)
+static void scull_dev_release(struct kref* ref)
+{
+    struct scull_dev *dev = container_of(ref, struct scull_dev, ref);
+
+    scull_trim(dev);
+    vfree(dev->kv_table);
+    kfree(dev);
+}
+
+/*
+ * Walk to qset item n, allocating missing items with gfp. A gfp of 0 only
+ * looks the item up and returns NULL if it does not exist.
+ */
+struct scull_qset* scull_follow(struct scull_dev* dev, int n, gfp_t gfp)
 {
     struct scull_qset *qs = dev->data;
 
     if (!qs) {
-        qs = dev->data = kmalloc(sizeof(scull_qset), GFP_KERNEL);
+        if (!gfp)
+            return NULL;
+        qs = dev->data = kmalloc(sizeof(struct scull_qset), gfp);
         if (!qs)
             return NULL;
         memset(qs, 0, sizeof(struct scull_qset));
@@ -73,7 +246,9 @@ struct scull_qset* scull_follow(struct scull_dev* dev, int n)
 
     while (n--) {
         if (!qs->next) {
-            qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+            if (!gfp)
+                return NULL;
+            qs->next = kmalloc(sizeof(struct scull_qset), gfp);
             if (qs->next == NULL)
                 return NULL;
             memset(qs->next, 0, sizeof(struct scull_qset));
@@ -85,6 +260,418 @@ struct scull_qset* scull_follow(struct scull_dev* dev, int n)
     return qs;
 }
 
+/*
+ * Return the quantum holding byte pos of the device. With a non-zero gfp
+ * the missing qset item, pointer array and quantum are allocated on the
+ * way, otherwise NULL is returned for holes. Called with dev->mutex held.
+ */
+static char* scull_quantum_at(struct scull_dev* dev, loff_t pos, gfp_t gfp)
+{
+    struct scull_qset *ptr;
+    int quantum = dev->quantum;
+    int qset = dev->qset;
+    int item_size = quantum * qset;
+    int item, s_pos;
+
+    item = (long) pos / item_size;
+    s_pos = ((long) pos % item_size) / quantum;
+
+    ptr = scull_follow(dev, item, gfp);
+    if (ptr == NULL)
+        return NULL;
+
+    if (!ptr->data) {
+        if (!gfp)
+            return NULL;
+        ptr->data = kmalloc(qset * sizeof(char*), gfp);
+        if (!ptr->data)
+            return NULL;
+        memset(ptr->data, 0, qset * sizeof(char*));
+    }
+
+    if (!ptr->data[s_pos] && gfp) {
+        ptr->data[s_pos] = kmalloc(quantum * sizeof(char), gfp);
+        if (!ptr->data[s_pos])
+            return NULL;
+        memset(ptr->data[s_pos], 0, quantum * sizeof(char));
+    }
+
+    return ptr->data[s_pos];
+}
+
+/*
+ * Bytes readable from the device. Log writers publish dev->size after their
+ * data without taking dev->mutex, so readers must acquire it.
+ */
+static inline unsigned long scull_size(struct scull_dev* dev)
+{
+    return smp_load_acquire(&dev->size);
+}
+
+/*
+ * Copy count bytes between the device at pos and the pinned pages, starting
+ * offset bytes into the first page. Whole quanta are moved per iteration
+ * instead of one quantum per system call. Called with dev->mutex held,
+ * returns the number of bytes copied or -ENOMEM if nothing could be written.
+ */
+static ssize_t scull_copy_pages(struct scull_dev* dev, struct page** pages,
+        unsigned long offset, size_t count, loff_t pos, int write)
+{
+    unsigned long size = scull_size(dev);
+    size_t done = 0;
+
+    if (!write) {
+        if (pos >= size)
+            return 0;
+        if (pos + count > size)
+            count = size - pos;
+    }
+
+    while (done < count) {
+        int q_pos = (long) (pos + done) % dev->quantum;
+        size_t len = min_t(size_t, count - done, dev->quantum - q_pos);
+        char *q = scull_quantum_at(dev, pos + done,
+                write ? GFP_KERNEL : 0);
+
+        if (!q)
+            break;
+
+        q += q_pos;
+        while (len) {
+            unsigned long p = offset + done;
+            unsigned int p_off = p & ~PAGE_MASK;
+            size_t n = min_t(size_t, len, PAGE_SIZE - p_off);
+            char *kaddr = kmap_atomic(pages[p >> PAGE_SHIFT]);
+
+            if (write)
+                memcpy(q, kaddr + p_off, n);
+            else
+                memcpy(kaddr + p_off, q, n);
+            kunmap_atomic(kaddr);
+
+            q += n;
+            len -= n;
+            done += n;
+        }
+    }
+
+    if (write) {
+        if (!done && count)
+            return -ENOMEM;
+        if (dev->size < pos + done)
+            dev->size = pos + done;
+    }
+
+    return done;
+}
+
+/*
+ * Large request path: pin up to SCULL_DIO_PIN_PAGES of the user buffer
+ * while the device is unlocked, since pinning may have to fault pages in,
+ * then copy it in chunks of SCULL_DIO_CHUNK_PAGES pages, dropping the lock
+ * between chunks so other users of the device are not starved.
+ */
+static ssize_t scull_dio_xfer(struct scull_dev* dev, char __user *buf,
+        size_t count, loff_t *f_pos, int write)
+{
+    unsigned long addr = (unsigned long) buf;
+    struct page **pages;
+    size_t done = 0;
+    ssize_t retval = 0;
+
+    pages = kmalloc(SCULL_DIO_PIN_PAGES * sizeof(struct page*), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+
+    while (done < count) {
+        unsigned long offset = (addr + done) & ~PAGE_MASK;
+        size_t batch = min_t(size_t, count - done,
+                SCULL_DIO_PIN_PAGES * PAGE_SIZE - offset);
+        int nr_pages = DIV_ROUND_UP(offset + batch, PAGE_SIZE);
+        size_t copied = 0;
+        int pinned;
+
+        /* reading the device writes into the user pages */
+        pinned = scull_pin_pages(addr + done, nr_pages, !write, pages);
+        if (pinned <= 0) {
+            retval = pinned ? pinned : -EFAULT;
+            break;
+        }
+        if (pinned < nr_pages)
+            batch = pinned * PAGE_SIZE - offset;
+
+        while (copied < batch) {
+            size_t chunk = min_t(size_t, batch - copied,
+                    SCULL_DIO_CHUNK_PAGES * PAGE_SIZE);
+
+            if (mutex_lock_interruptible(&dev->mutex)) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+            retval = scull_copy_pages(dev, pages, offset + copied, chunk,
+                    *f_pos + done + copied, write);
+            mutex_unlock(&dev->mutex);
+
+            if (retval <= 0)
+                break;
+            copied += retval;
+            if (retval < chunk)
+                break;
+        }
+
+        scull_unpin_pages(pages, pinned, !write);
+
+        done += copied;
+        if (copied < batch)
+            break;
+    }
+
+    kfree(pages);
+
+    if (done) {
+        *f_pos += done;
+        return done;
+    }
+    return retval;
+}
+
+/*
+ * Return *slot, installing a zeroed allocation of size bytes if it is
+ * still empty and gfp is not 0. Racing installers agree on the first one
+ * published.
+ */
+static void* scull_log_install(void** slot, size_t size, gfp_t gfp)
+{
+    void *p = READ_ONCE(*slot);
+    void *new;
+
+    if (p || !gfp)
+        return p;
+
+    new = kzalloc(size, gfp);
+    if (!new)
+        return NULL;
+
+    p = cmpxchg(slot, NULL, new);
+    if (p) {
+        kfree(new);
+        return p;
+    }
+    return new;
+}
+
+/*
+ * Lock-free scull_quantum_at() for SCULL_DEV_LOG devices. Their storage is
+ * only ever grown while the device is alive, so no lock is needed to walk
+ * it.
+ */
+static char* scull_log_quantum(struct scull_dev* dev, unsigned long pos,
+        gfp_t gfp)
+{
+    int quantum = dev->quantum;
+    int qset = dev->qset;
+    int item_size = quantum * qset;
+    int item = pos / item_size;
+    int s_pos = (pos % item_size) / quantum;
+    void **slot = (void**) &dev->data;
+    struct scull_qset *qs;
+
+    for (;;) {
+        qs = scull_log_install(slot, sizeof(struct scull_qset), gfp);
+        if (!qs)
+            return NULL;
+        if (!item--)
+            break;
+        slot = (void**) &qs->next;
+    }
+
+    if (!scull_log_install((void**) &qs->data, qset * sizeof(char*), gfp))
+        return NULL;
+    return scull_log_install(&qs->data[s_pos], quantum * sizeof(char), gfp);
+}
+
+/*
+ * A record finished while an earlier one is still being copied, left on
+ * dev->log_pending for the writer that closes the gap to publish.
+ */
+struct scull_log_pending {
+    struct list_head list;
+    unsigned long off;
+    unsigned long end;
+};
+
+/*
+ * Publish the record [off, end) if everything before it is published,
+ * together with the pending records it makes contiguous; otherwise queue
+ * it in rec. Never waits for other writers. Consumes rec.
+ */
+static void scull_log_publish(struct scull_dev* dev,
+        struct scull_log_pending* rec, unsigned long off, unsigned long end)
+{
+    struct scull_log_pending *p, *tmp;
+    LIST_HEAD(done);
+
+    spin_lock(&dev->log_lock);
+    if (dev->size != off) {
+        rec->off = off;
+        rec->end = end;
+        list_for_each_entry(p, &dev->log_pending, list)
+            if (p->off > off)
+                break;
+        list_add_tail(&rec->list, &p->list);
+        spin_unlock(&dev->log_lock);
+        return;
+    }
+
+    list_for_each_entry_safe(p, tmp, &dev->log_pending, list) {
+        if (p->off != end)
+            break;
+        end = p->end;
+        list_move_tail(&p->list, &done);
+    }
+    smp_store_release(&dev->size, end);
+    spin_unlock(&dev->log_lock);
+
+    kfree(rec);
+    list_for_each_entry_safe(p, tmp, &done, list)
+        kfree(p);
+}
+
+/*
+ * Reserve count bytes at the tail. The quanta backing them are allocated
+ * before the tail moves past them, so a reserved record can never end up
+ * over a hole; if the allocation fails nothing is reserved. Quanta left
+ * over by a lost race are used by the writer that won it.
+ */
+static int scull_log_reserve(struct scull_dev* dev, size_t count,
+        unsigned long* offp, gfp_t gfp)
+{
+    unsigned long off = atomic_long_read(&dev->log_tail);
+    unsigned long old, pos;
+
+    for (;;) {
+        for (pos = off - off % dev->quantum; pos < off + count;
+                pos += dev->quantum)
+            if (!scull_log_quantum(dev, pos, gfp))
+                return -ENOMEM;
+
+        old = atomic_long_cmpxchg(&dev->log_tail, off, off + count);
+        if (old == off)
+            break;
+        off = old;
+    }
+
+    *offp = off;
+    return 0;
+}
+
+/*
+ * Zero the first len bytes of the record at off, whose quanta all exist.
+ */
+static void scull_log_void(struct scull_dev* dev, unsigned long off,
+        size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        int q_pos = (off + done) % dev->quantum;
+        size_t n = min_t(size_t, len - done, dev->quantum - q_pos);
+
+        memset(scull_log_quantum(dev, off + done, 0) + q_pos, 0, n);
+        done += n;
+    }
+}
+
+/*
+ * Append a record to a SCULL_DEV_LOG device without taking dev->mutex.
+ * The record's offset is reserved on the tail with its storage already in
+ * place, then the data is copied in parallel with other writers. dev->size
+ * only advances over finished records, in reservation order, so readers
+ * never see a record that is still being written. Writers do not wait for
+ * each other: a record that finishes early is published by the writer
+ * ahead of it, so the call can return before its record is visible.
+ *
+ * Once reserved, a record is always published so that it does not hold
+ * back the records behind it. If the user buffer faults it is published
+ * zero-filled instead of half-written, -EFAULT is returned and *offp still
+ * tells the caller which record was voided.
+ */
+static ssize_t scull_log_append(struct scull_dev* dev, struct iov_iter *iter,
+        loff_t *offp, gfp_t gfp)
+{
+    size_t count = iov_iter_count(iter);
+    struct scull_log_pending *rec;
+    unsigned long off;
+    size_t done = 0;
+
+    if (!count)
+        return 0;
+
+    /* allocated before reserving, so that publishing cannot fail */
+    rec = kmalloc(sizeof(struct scull_log_pending), gfp);
+    if (!rec || scull_log_reserve(dev, count, &off, gfp)) {
+        kfree(rec);
+        return gfpflags_allow_blocking(gfp) ? -ENOMEM : -EAGAIN;
+    }
+
+    while (done < count) {
+        int q_pos = (off + done) % dev->quantum;
+        size_t len = min_t(size_t, count - done, dev->quantum - q_pos);
+        char *q = scull_log_quantum(dev, off + done, 0);
+        size_t n = copy_from_iter(q + q_pos, len, iter);
+
+        done += n;
+        if (n < len) {
+            scull_log_void(dev, off, done);
+            break;
+        }
+    }
+
+    scull_log_publish(dev, rec, off, off + count);
+
+    *offp = off;
+    return done == count ? count : -EFAULT;
+}
+
+static ssize_t scull_iter_xfer(struct scull_dev* dev, struct iov_iter *iter,
+        loff_t pos, int write, gfp_t gfp);
+static long scull_kv_ioctl(struct scull_dev* dev, unsigned int cmd,
+        unsigned long arg);
+
+/*
+ * Append one record and report the offset it was written at, and whether
+ * it was voided.
+ */
+static long scull_log_ioctl(struct scull_dev* dev, unsigned long arg)
+{
+    struct scull_log_rec __user *urec = (struct scull_log_rec __user*) arg;
+    struct scull_log_rec rec;
+    struct iovec iov;
+    struct iov_iter iter;
+    loff_t off = 0;
+    ssize_t ret;
+
+    if (!(dev->flags & SCULL_DEV_LOG))
+        return -ENOTTY;
+    if (copy_from_user(&rec, urec, sizeof(rec)))
+        return -EFAULT;
+
+    ret = scull_import(WRITE, (void __user*) rec.buf, rec.len,
+            &iov, &iter);
+    if (ret)
+        return ret;
+
+    ret = scull_log_append(dev, &iter, &off, GFP_KERNEL);
+    if (ret < 0 && ret != -EFAULT)
+        return ret;
+
+    /* a voided record is reported too, so the caller can skip it */
+    rec.result = ret < 0 ? ret : 0;
+    if (put_user(off, &urec->offset) || put_user(rec.result, &urec->result))
+        return -EFAULT;
+    return rec.result;
+}
+
 long scull_ioctl(struct file* filp, unsigned int cmd,
         unsigned long arg)
 {
@@ -98,10 +685,10 @@ long scull_ioctl(struct file* filp, unsigned int cmd,
     if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
 
     if (_IOC_DIR(cmd) & _IOC_READ)
-        err = !access_ok(VERIFY_WRITE, (void __user *)arg,
+        err = !scull_access_ok(VERIFY_WRITE, (void __user *)arg,
                 _IOC_SIZE(cmd));
     else if (_IOC_DIR(cmd) & _IOC_WRITE)
-        err = !access_ok(VERIFY_READ, (void __user *)arg,
+        err = !scull_access_ok(VERIFY_READ, (void __user *)arg,
                 _IOC_SIZE(cmd));
 
     if (err) return -EFAULT;
@@ -184,6 +771,15 @@ long scull_ioctl(struct file* filp, unsigned int cmd,
             tmp = scull_qset;
             scull_qset = arg;
             return tmp;
+        /*Key-value index: arg points to a struct scull_kv(_batch)*/
+        case SCULL_IOCKVPUT:
+        case SCULL_IOCKVGET:
+        case SCULL_IOCKVDEL:
+        case SCULL_IOCKVMGET:
+            return scull_kv_ioctl(filp->private_data, cmd, arg);
+        /*Log append: arg points to a struct scull_log_rec*/
+        case SCULL_IOCLOGAPPEND:
+            return scull_log_ioctl(filp->private_data, arg);
         default:
             return -EINVAL;
     }
@@ -195,34 +791,31 @@ ssize_t scull_read(struct file* filp, char __user *buf,
         size_t count, loff_t *f_pos)
 {
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *ptr;
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int item_size = quantum * qset;
-    int item, s_pos, q_pos, rest;
+    unsigned long size;
+    int q_pos;
+    char *q;
     int retval = 0;
 
+    if (count >= SCULL_DIO_THRESHOLD)
+        return scull_dio_xfer(dev, buf, count, f_pos, 0);
+
     if (mutex_lock_interruptible(&dev->mutex))
         return -ERESTARTSYS;
-    if (*f_pos >= dev->size)
+    size = scull_size(dev);
+    if (*f_pos >= size)
         goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
-
-    item = (long) *f_pos / item_size;
-    rest = (long) *f_pos % item_size;
+    if (*f_pos + count > size)
+        count = size - *f_pos;
 
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    q_pos = (long) *f_pos % dev->quantum;
+    q = scull_quantum_at(dev, *f_pos, 0);
 
-    ptr = scull_follow(dev, item);
-
-    if (ptr == NULL || !ptr->data || !ptr->data[s_pos])
+    if (q == NULL)
         goto out;
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+    if (count > dev->quantum - q_pos)
+        count = dev->quantum - q_pos;
 
-    if (copy_to_user(buf, ptr->data[s_pos] + q_pos, count)) {
+    if (copy_to_user(buf, q + q_pos, count)) {
         retval = -EFAULT;
         goto out;
     }
@@ -238,45 +831,63 @@ ssize_t scull_write(struct file* filp, const char __user *buf,
         size_t count, loff_t *f_pos)
 {
     struct scull_dev *dev = filp->private_data;
-    struct scull_qset *ptr;
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int item_size = quantum * qset;
-    int item, s_pos, q_pos, rest;
+    int q_pos;
+    char *q;
     int retval = 0;
 
-    if (mutex_lock_interruptible(&dev->mutex))
-        return -ERESTARTSYS;
+    /* the values of a KV device only change through SCULL_IOCKVPUT */
+    if (dev->flags & SCULL_DEV_KV)
+        return -EINVAL;
+
+    if (dev->flags & SCULL_DEV_LOG) {
+        struct iovec iov;
+        struct iov_iter iter;
+        loff_t off = 0;
+        ssize_t ret;
+
+        ret = scull_import(WRITE, (char __user *) buf, count,
+                &iov, &iter);
+        if (ret)
+            return ret;
+        ret = scull_log_append(dev, &iter, &off, GFP_KERNEL);
+        if (ret > 0)
+            *f_pos = off + ret;
+        return ret;
+    }
 
-    item = (long) *f_pos / item_size;
-    rest = (long) *f_pos % item_size;
+    /* appends are only atomic while the mutex is held throughout */
+    if (count >= SCULL_DIO_THRESHOLD && !(filp->f_flags & O_APPEND))
+        return scull_dio_xfer(dev, (char __user *) buf, count, f_pos, 1);
 
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
 
-    ptr = scull_follow(dev, item);
+    /* the whole record lands at the tail, not just up to the quantum end */
+    if (filp->f_flags & O_APPEND) {
+        struct iovec iov;
+        struct iov_iter iter;
 
-    if (ptr == NULL)
-        goto out;
-    if (!ptr->data) {
-        ptr->data = kmalloc(qset * sizeof(char*), GFP_KERNEL);
-        if (!ptr->data)
+        retval = scull_import(WRITE, (char __user *) buf, count,
+                &iov, &iter);
+        if (retval)
             goto out;
-        memset(ptr->data, 0, qset * sizeof(char*));
+        *f_pos = dev->size;
+        retval = scull_iter_xfer(dev, &iter, *f_pos, 1, GFP_KERNEL);
+        if (retval > 0)
+            *f_pos += retval;
+        goto out;
     }
 
-    if (!ptr->data[s_pos]) {
-        ptr->data[s_pos] = kmalloc(quantum * sizeof(char),
-                GFP_KERNEL);
-        if (!ptr->data[s_pos])
-            goto out;
-        memset(ptr->data[s_pos], 0, quantum * sizeof(char));
-    }
+    q_pos = (long) *f_pos % dev->quantum;
+    q = scull_quantum_at(dev, *f_pos, GFP_KERNEL);
+
+    if (q == NULL)
+        goto out;
 
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+    if (count > dev->quantum - q_pos)
+        count = dev->quantum - q_pos;
 
-    if (copy_from_user(ptr->data[s_pos] + q_pos, buf, count)) {
+    if (copy_from_user(q + q_pos, buf, count)) {
         PDEBUG("error happend copy_to_user\n");
         retval = -EFAULT;
         goto out;
@@ -293,16 +904,507 @@ out:
     return retval;
 }
 
+/*
+ * Move the iterator contents between the device and pos, whole quanta per
+ * iteration. Quanta are allocated with gfp when writing. Called with
+ * dev->mutex held, returns the bytes copied or a negative error if none.
+ */
+static ssize_t scull_iter_xfer(struct scull_dev* dev, struct iov_iter *iter,
+        loff_t pos, int write, gfp_t gfp)
+{
+    unsigned long size = scull_size(dev);
+    size_t count = iov_iter_count(iter);
+    size_t done = 0;
+    ssize_t err = 0;
+
+    if (!write) {
+        if (pos >= size)
+            return 0;
+        if (pos + count > size)
+            count = size - pos;
+    }
+
+    while (done < count) {
+        int q_pos = (long) (pos + done) % dev->quantum;
+        size_t len = min_t(size_t, count - done, dev->quantum - q_pos);
+        char *q = scull_quantum_at(dev, pos + done, write ? gfp : 0);
+        size_t n;
+
+        if (!q) {
+            err = write ? -ENOMEM : 0;
+            break;
+        }
+
+        if (write)
+            n = copy_from_iter(q + q_pos, len, iter);
+        else
+            n = copy_to_iter(q + q_pos, len, iter);
+
+        done += n;
+        if (n < len) {
+            err = -EFAULT;
+            break;
+        }
+    }
+
+    if (write && dev->size < pos + done)
+        dev->size = pos + done;
+
+    return done ? done : err;
+}
+
+/*
+ * Copy the request's key into key and hash it.
+ */
+static int scull_kv_key(const struct scull_kv* kv, u8* key, u32* hash)
+{
+    if (kv->key_len == 0 || kv->key_len > SCULL_KV_MAX_KEY)
+        return -EINVAL;
+    if (copy_from_user(key, (const void __user*) kv->key, kv->key_len))
+        return -EFAULT;
+    *hash = jhash(key, kv->key_len, 0);
+    return 0;
+}
+
+static struct hlist_head* scull_kv_bucket(struct scull_dev* dev, u32 hash)
+{
+    return &dev->kv_table[hash & ((1 << dev->kv_bits) - 1)];
+}
+
+static struct scull_kv_entry* scull_kv_find(struct scull_dev* dev,
+        const u8* key, unsigned int key_len, u32 hash)
+{
+    struct scull_kv_entry *e;
+
+    hlist_for_each_entry(e, scull_kv_bucket(dev, hash), node)
+        if (e->hash == hash && e->key_len == key_len &&
+                !memcmp(e->key, key, key_len))
+            return e;
+    return NULL;
+}
+
+/*
+ * Copy the value of kv->key into kv->val, truncated to kv->val_len bytes;
+ * kv->val_len is updated to the full value length. Called with dev->mutex
+ * held.
+ */
+static int scull_kv_get(struct scull_dev* dev, struct scull_kv* kv, u8* key)
+{
+    struct scull_kv_entry *e;
+    struct iovec iov;
+    struct iov_iter iter;
+    size_t len;
+    ssize_t ret;
+    u32 hash;
+
+    ret = scull_kv_key(kv, key, &hash);
+    if (ret)
+        return ret;
+
+    e = scull_kv_find(dev, key, kv->key_len, hash);
+    if (!e)
+        return -ENOENT;
+
+    len = min_t(size_t, kv->val_len, e->len);
+    if (len) {
+        ret = scull_import(READ, (void __user*) kv->val, len,
+                &iov, &iter);
+        if (ret)
+            return ret;
+        ret = scull_iter_xfer(dev, &iter, e->off, 0, 0);
+        if (ret < 0)
+            return ret;
+        if (ret < len)
+            return -EIO;
+    }
+
+    kv->val_len = e->len;
+    return 0;
+}
+
+/*
+ * Copy len bytes from src at src_off to dst at dst_off, allocating the
+ * destination quanta. Both devices are locked by the caller.
+ */
+static int scull_kv_move(struct scull_dev* dst, loff_t dst_off,
+        struct scull_dev* src, loff_t src_off, size_t len)
+{
+    while (len) {
+        int s_pos = (long) src_off % src->quantum;
+        int d_pos = (long) dst_off % dst->quantum;
+        size_t n = min3(len, (size_t) (src->quantum - s_pos),
+                (size_t) (dst->quantum - d_pos));
+        char *s = scull_quantum_at(src, src_off, 0);
+        char *d = scull_quantum_at(dst, dst_off, GFP_KERNEL);
+
+        if (!s || !d)
+            return -ENOMEM;
+        memcpy(d + d_pos, s + s_pos, n);
+
+        src_off += n;
+        dst_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Rewrite the live values back to back into fresh storage and drop the old
+ * one. Values are laid out in index order, so a second walk of the index
+ * assigns the same offsets the copy used. On failure the device is left as
+ * it was. Called with dev->mutex held.
+ */
+static int scull_kv_compact(struct scull_dev* dev)
+{
+    struct scull_dev tmp = {
+        .quantum = dev->quantum,
+        .qset = dev->qset,
+    };
+    struct scull_kv_entry *e;
+    struct scull_qset *old;
+    loff_t off = 0;
+    int i;
+
+    for (i = 0; i < (1 << dev->kv_bits); i++)
+        hlist_for_each_entry(e, &dev->kv_table[i], node) {
+            if (scull_kv_move(&tmp, off, dev, e->off, e->len)) {
+                scull_trim(&tmp);
+                return -ENOMEM;
+            }
+            off += e->len;
+        }
+
+    off = 0;
+    for (i = 0; i < (1 << dev->kv_bits); i++)
+        hlist_for_each_entry(e, &dev->kv_table[i], node) {
+            e->off = off;
+            off += e->len;
+        }
+
+    PDEBUG("scull%d: compacted %lu bytes to %lld\n", dev->index,
+            dev->size, off);
+    old = dev->data;
+    dev->data = tmp.data;
+    dev->size = off;
+    dev->kv_dead = 0;
+    tmp.data = old;
+    scull_trim(&tmp);
+    return 0;
+}
+
+/*
+ * Append the value at the end of the device and point the key at it. The
+ * space of replaced and deleted values is reclaimed by compacting the
+ * device once it is mostly dead, which costs a copy of the live values but
+ * keeps a store that is rewritten in place from growing without bound.
+ * Called with dev->mutex held.
+ */
+static int scull_kv_put(struct scull_dev* dev, struct scull_kv* kv, u8* key)
+{
+    struct scull_kv_entry *e;
+    struct iovec iov;
+    struct iov_iter iter;
+    loff_t off;
+    ssize_t ret;
+    u32 hash;
+
+    ret = scull_kv_key(kv, key, &hash);
+    if (ret)
+        return ret;
+
+    /* best effort: without memory for a copy the store just keeps growing */
+    if (dev->kv_dead >= SCULL_KV_COMPACT_MIN && dev->kv_dead > dev->size / 2)
+        scull_kv_compact(dev);
+
+    off = dev->size;
+
+    if (kv->val_len) {
+        ret = scull_import(WRITE, (void __user*) kv->val, kv->val_len,
+                &iov, &iter);
+        if (ret)
+            return ret;
+        ret = scull_iter_xfer(dev, &iter, off, 1, GFP_KERNEL);
+        if (ret < 0)
+            return ret;
+        if (ret < kv->val_len)
+            return -ENOMEM;
+    }
+
+    e = scull_kv_find(dev, key, kv->key_len, hash);
+    if (!e) {
+        e = kmalloc(sizeof(struct scull_kv_entry) + kv->key_len,
+                GFP_KERNEL);
+        if (!e)
+            return -ENOMEM;
+        e->hash = hash;
+        e->key_len = kv->key_len;
+        memcpy(e->key, key, kv->key_len);
+        hlist_add_head(&e->node, scull_kv_bucket(dev, hash));
+    } else {
+        dev->kv_dead += e->len;
+    }
+
+    e->off = off;
+    e->len = kv->val_len;
+    return 0;
+}
+
+static int scull_kv_del(struct scull_dev* dev, struct scull_kv* kv, u8* key)
+{
+    struct scull_kv_entry *e;
+    u32 hash;
+    int ret;
+
+    ret = scull_kv_key(kv, key, &hash);
+    if (ret)
+        return ret;
+
+    e = scull_kv_find(dev, key, kv->key_len, hash);
+    if (!e)
+        return -ENOENT;
+
+    dev->kv_dead += e->len;
+    hlist_del(&e->node);
+    kfree(e);
+    return 0;
+}
+
+/*
+ * GET/PUT/DELETE take a struct scull_kv, MGET a struct scull_kv_batch whose
+ * entries each get their own result. The whole batch runs under one hold
+ * of dev->mutex.
+ */
+static long scull_kv_ioctl(struct scull_dev* dev, unsigned int cmd,
+        unsigned long arg)
+{
+    struct scull_kv __user *ukv = (struct scull_kv __user*) arg;
+    struct scull_kv_batch batch;
+    struct scull_kv kv;
+    u8 key[SCULL_KV_MAX_KEY];
+    long retval = 0;
+    unsigned int i;
+
+    if (!(dev->flags & SCULL_DEV_KV))
+        return -ENOTTY;
+
+    if (cmd == SCULL_IOCKVMGET) {
+        if (copy_from_user(&batch, (void __user*) arg, sizeof(batch)))
+            return -EFAULT;
+        if (batch.nr > SCULL_KV_MAX_BATCH)
+            return -EINVAL;
+    } else if (copy_from_user(&kv, ukv, sizeof(kv))) {
+        return -EFAULT;
+    }
+
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+
+    switch (cmd) {
+        case SCULL_IOCKVPUT:
+            retval = scull_kv_put(dev, &kv, key);
+            break;
+
+        case SCULL_IOCKVGET:
+            retval = scull_kv_get(dev, &kv, key);
+            if (retval == 0 && put_user(kv.val_len, &ukv->val_len))
+                retval = -EFAULT;
+            break;
+
+        case SCULL_IOCKVDEL:
+            retval = scull_kv_del(dev, &kv, key);
+            break;
+
+        case SCULL_IOCKVMGET:
+            for (i = 0; i < batch.nr; i++) {
+                ukv = (struct scull_kv __user*) batch.ops + i;
+                if (copy_from_user(&kv, ukv, sizeof(kv))) {
+                    retval = -EFAULT;
+                    break;
+                }
+                kv.result = scull_kv_get(dev, &kv, key);
+                if (put_user(kv.val_len, &ukv->val_len) ||
+                        put_user(kv.result, &ukv->result)) {
+                    retval = -EFAULT;
+                    break;
+                }
+            }
+            break;
+    }
+
+    mutex_unlock(&dev->mutex);
+    return retval;
+}
+
+static inline int scull_iocb_nowait(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+    return iocb->ki_flags & IOCB_NOWAIT;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * An asynchronous request handed over to scull_aio_wq. The iterator is
+ * duplicated since the submitter's copy goes away with the system call,
+ * and the submitter's mm is borrowed to reach user buffers.
+ */
+struct scull_aio {
+    struct work_struct work;
+    struct kiocb *iocb;
+    struct iov_iter iter;
+    const void *iov;
+    struct mm_struct *mm;
+    int write;
+};
+
+static void scull_aio_work(struct work_struct *work)
+{
+    struct scull_aio *req = container_of(work, struct scull_aio, work);
+    struct kiocb *iocb = req->iocb;
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    ssize_t retval;
+
+    if (req->mm)
+        scull_use_mm(req->mm);
+
+    mutex_lock(&dev->mutex);
+    if (req->write && iocb->ki_flags & IOCB_APPEND)
+        iocb->ki_pos = dev->size;
+    retval = scull_iter_xfer(dev, &req->iter, iocb->ki_pos, req->write,
+            GFP_KERNEL);
+    mutex_unlock(&dev->mutex);
+
+    if (req->mm) {
+        scull_unuse_mm(req->mm);
+        mmput(req->mm);
+    }
+
+    if (retval > 0)
+        iocb->ki_pos += retval;
+
+    kfree(req->iov);
+    kfree(req);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    iocb->ki_complete(iocb, retval);
+#else
+    iocb->ki_complete(iocb, retval, 0);
+#endif
+}
+
+static ssize_t scull_aio_queue(struct kiocb *iocb, struct iov_iter *iter,
+        int write)
+{
+    struct scull_aio *req;
+
+    req = kmalloc(sizeof(struct scull_aio), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+
+    if (scull_dup_iter(&req->iter, iter, &req->iov)) {
+        kfree(req);
+        return -ENOMEM;
+    }
+
+    req->mm = scull_user_iter(iter) ? get_task_mm(current) : NULL;
+    req->iocb = iocb;
+    req->write = write;
+    INIT_WORK(&req->work, scull_aio_work);
+    queue_work(scull_aio_wq, &req->work);
+
+    return -EIOCBQUEUED;
+}
+
+/*
+ * Common read_iter/write_iter path. IOCB_NOWAIT callers get -EAGAIN rather
+ * than sleeping on the mutex or the allocator. Asynchronous callers are
+ * completed from scull_aio_wq when the device is busy or the request is
+ * large, so the submitting thread never blocks here.
+ */
+static ssize_t scull_iter_rw(struct kiocb *iocb, struct iov_iter *iter,
+        int write)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    gfp_t gfp = GFP_KERNEL;
+    loff_t off = 0;
+    ssize_t retval;
+
+    if (write && dev->flags & SCULL_DEV_KV)
+        return -EINVAL;
+
+    /* log appends never sleep on other writers, async ones included */
+    if (write && dev->flags & SCULL_DEV_LOG) {
+        retval = scull_log_append(dev, iter, &off,
+                scull_iocb_nowait(iocb) ? GFP_NOWAIT : GFP_KERNEL);
+        if (retval > 0)
+            iocb->ki_pos = off + retval;
+        return retval;
+    }
+
+    if (scull_iocb_nowait(iocb)) {
+        if (!mutex_trylock(&dev->mutex))
+            return -EAGAIN;
+        gfp = GFP_NOWAIT;
+    } else if (!is_sync_kiocb(iocb)) {
+        if (iov_iter_count(iter) >= SCULL_DIO_THRESHOLD ||
+                !mutex_trylock(&dev->mutex))
+            return scull_aio_queue(iocb, iter, write);
+    } else if (mutex_lock_interruptible(&dev->mutex)) {
+        return -ERESTARTSYS;
+    }
+
+    if (write && iocb->ki_flags & IOCB_APPEND)
+        iocb->ki_pos = dev->size;
+    retval = scull_iter_xfer(dev, iter, iocb->ki_pos, write, gfp);
+    mutex_unlock(&dev->mutex);
+
+    if (retval > 0)
+        iocb->ki_pos += retval;
+    else if (retval == -ENOMEM && gfp == GFP_NOWAIT)
+        retval = -EAGAIN;
+
+    return retval;
+}
+
+static ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    return scull_iter_rw(iocb, to, 0);
+}
+
+static ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    return scull_iter_rw(iocb, from, 1);
+}
+
 static int scull_open(struct inode* inode, struct file* filp)
 {
     struct scull_dev* dev;
-    dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+
+    mutex_lock(&scull_idr_lock);
+    dev = idr_find(&scull_idr, iminor(inode) - scull_minor);
+    if (dev)
+        kref_get(&dev->ref);
+    mutex_unlock(&scull_idr_lock);
+
+    if (!dev)
+        return -ENODEV;
 
     filp->private_data = dev;
+#ifdef FMODE_NOWAIT
+    /* without it the VFS fails IOCB_NOWAIT requests before they get here */
+    filp->f_mode |= FMODE_NOWAIT;
+#endif
 
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->mutex))
+    /*
+     * log devices are append-only and never trimmed while alive, KV devices
+     * would lose their index with the data
+     */
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY &&
+            !(dev->flags & (SCULL_DEV_LOG | SCULL_DEV_KV))) {
+        if (mutex_lock_interruptible(&dev->mutex)) {
+            kref_put(&dev->ref, scull_dev_release);
             return -ERESTARTSYS;
+        }
         scull_trim(dev);
         mutex_unlock(&dev->mutex);
     }
@@ -312,6 +1414,9 @@ static int scull_open(struct inode* inode, struct file* filp)
 
 int scull_release(struct inode* inode, struct file* filp)
 {
+    struct scull_dev *dev = filp->private_data;
+
+    kref_put(&dev->ref, scull_dev_release);
     return 0;
 }
 
@@ -328,7 +1433,7 @@ loff_t scull_llseek(struct file* filp, loff_t off, int whence)
             newpos = filp->f_pos + off;
             break;
         case 2: /* SEEK END */
-            newpos = dev->size + off;
+            newpos = scull_size(dev) + off;
             break;
         default:
             return -EINVAL;
@@ -345,29 +1450,224 @@ struct file_operations scull_fops = {
     .release = scull_release,
     .read = scull_read,
     .write = scull_write,
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
     .llseek = scull_llseek,
     .unlocked_ioctl = scull_ioctl,
 };
 
+/*
+ * The cdev is allocated separately from the device: open files keep a
+ * reference to it that may outlive scull_destroy_dev().
+ */
+static int scull_setup_cdev(struct scull_dev* dev, int index)
+{
+    int err, devno = MKDEV(scull_major, scull_minor + index);
+    struct device *device;
+
+    dev->cdev = cdev_alloc();
+    if (!dev->cdev)
+        return -ENOMEM;
+    dev->cdev->owner = THIS_MODULE;
+    dev->cdev->ops = &scull_fops;
+    err = cdev_add(dev->cdev, devno, 1);
+    if (err) {
+        printk(KERN_NOTICE "Error %d: adding scull %d\n", err, index);
+        kobject_put(&dev->cdev->kobj);
+        return err;
+    }
+
+    device = device_create(scull_class, NULL, devno, NULL,
+            "scull%d", index);
+    if (IS_ERR(device)) {
+        cdev_del(dev->cdev);
+        return PTR_ERR(device);
+    }
+
+    return 0;
+}
+
+/*
+ * quantum * qset, the size of one qset item, is computed as an int by the
+ * I/O paths and must not overflow.
+ */
+static bool scull_geometry_ok(int quantum, int qset)
+{
+    return quantum > 0 && qset > 0 && (s64) quantum * qset <= INT_MAX;
+}
+
+/*
+ * Create a device with its own geometry, 0 meaning the module default.
+ * If out is given it is filled in with the resolved geometry before the
+ * device can be destroyed by anyone else.
+ */
+static struct scull_dev* scull_create_dev(const struct scull_geometry* geo,
+        struct scull_geometry* out)
+{
+    struct scull_dev *dev;
+    int index, err;
+
+    if (geo->quantum < 0 || geo->qset < 0 ||
+            geo->flags & ~(SCULL_DEV_KV | SCULL_DEV_LOG) ||
+            (geo->flags & SCULL_DEV_KV && geo->flags & SCULL_DEV_LOG))
+        return ERR_PTR(-EINVAL);
+
+    dev = kzalloc(sizeof(struct scull_dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    dev->def_quantum = geo->quantum;
+    dev->def_qset = geo->qset;
+    dev->quantum = geo->quantum ? geo->quantum : scull_quantum;
+    dev->qset = geo->qset ? geo->qset : scull_qset;
+    dev->flags = geo->flags;
+
+    if (!scull_geometry_ok(dev->quantum, dev->qset)) {
+        kfree(dev);
+        return ERR_PTR(-EINVAL);
+    }
+
+    if (dev->flags & SCULL_DEV_KV) {
+        dev->kv_bits = geo->kv_bits ? geo->kv_bits : SCULL_KV_BITS;
+        if (dev->kv_bits < 1 || dev->kv_bits > SCULL_KV_MAX_BITS) {
+            kfree(dev);
+            return ERR_PTR(-EINVAL);
+        }
+        dev->kv_table = vzalloc(sizeof(struct hlist_head) << dev->kv_bits);
+        if (!dev->kv_table) {
+            kfree(dev);
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+
+    mutex_init(&dev->mutex);
+    spin_lock_init(&dev->log_lock);
+    INIT_LIST_HEAD(&dev->log_pending);
+    kref_init(&dev->ref);
+
+    mutex_lock(&scull_idr_lock);
+    index = idr_alloc(&scull_idr, dev, 0, SCULL_MAX_DEVS, GFP_KERNEL);
+    if (index < 0) {
+        err = index == -ENOSPC ? -ENFILE : index;
+        goto fail;
+    }
+    dev->index = index;
+
+    err = scull_setup_cdev(dev, index);
+    if (err) {
+        idr_remove(&scull_idr, index);
+        goto fail;
+    }
+
+    if (out) {
+        out->index = index;
+        out->flags = dev->flags;
+        out->quantum = dev->quantum;
+        out->qset = dev->qset;
+        out->kv_bits = dev->kv_bits;
+    }
+    PDEBUG("created scull%d: quantum %d qset %d\n", index,
+            dev->quantum, dev->qset);
+    mutex_unlock(&scull_idr_lock);
+
+    return dev;
+fail:
+    mutex_unlock(&scull_idr_lock);
+    vfree(dev->kv_table);
+    kfree(dev);
+    return ERR_PTR(err);
+}
+
+/*
+ * Remove the device node; the storage is freed once the last open file
+ * referencing the device is released.
+ */
+static int scull_destroy_dev(int index)
+{
+    struct scull_dev *dev;
+
+    mutex_lock(&scull_idr_lock);
+    dev = idr_find(&scull_idr, index);
+    if (!dev) {
+        mutex_unlock(&scull_idr_lock);
+        return -ENODEV;
+    }
+    idr_remove(&scull_idr, index);
+    device_destroy(scull_class, MKDEV(scull_major, scull_minor + index));
+    cdev_del(dev->cdev);
+    mutex_unlock(&scull_idr_lock);
+
+    kref_put(&dev->ref, scull_dev_release);
+    return 0;
+}
+
+static long scull_ctl_ioctl(struct file* filp, unsigned int cmd,
+        unsigned long arg)
+{
+    struct scull_geometry geo;
+    struct scull_dev *dev;
+
+    if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    switch (cmd) {
+        /* Create: arg points to the geometry, index is filled in */
+        case SCULL_IOCCREATE:
+            if (copy_from_user(&geo, (void __user*) arg, sizeof(geo)))
+                return -EFAULT;
+            dev = scull_create_dev(&geo, &geo);
+            if (IS_ERR(dev))
+                return PTR_ERR(dev);
+            if (copy_to_user((void __user*) arg, &geo, sizeof(geo)))
+                return -EFAULT;
+            return 0;
+
+        /* Destroy: arg is the device index */
+        case SCULL_IOCDESTROY:
+            return scull_destroy_dev(arg);
+
+        default:
+            return -ENOTTY;
+    }
+}
+
+struct file_operations scull_ctl_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = scull_ctl_ioctl,
+};
+
 #ifdef SCULL_DEBUG
+/*
+ * *pos is the device index; the table stays locked from start to stop.
+ */
 static void* scull_seq_start(struct seq_file *s, loff_t *pos)
 {
-    if (*pos >= scull_nr_devs)
-        return NULL;
-    return scull_devices + *pos;
+    int id = *pos;
+    void *dev;
+
+    mutex_lock(&scull_idr_lock);
+    dev = idr_get_next(&scull_idr, &id);
+    if (dev)
+        *pos = id;
+    return dev;
 }
 
 static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
-    (*pos)++;
-    if (*pos >= scull_nr_devs)
-        return NULL;
-    return scull_devices + *pos;
+    int id = *pos + 1;
+    void *dev;
+
+    dev = idr_get_next(&scull_idr, &id);
+    *pos = dev ? id : *pos + 1;
+    return dev;
 }
 
 static void scull_seq_stop(struct seq_file *s, void *v)
 {
-    return;
+    mutex_unlock(&scull_idr_lock);
 }
 
 static int scull_seq_show(struct seq_file* s, void* v)
@@ -381,7 +1681,7 @@ static int scull_seq_show(struct seq_file* s, void* v)
         return -ERESTARTSYS;
 
     seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-            (int) (dev - scull_devices), dev->qset,
+            dev->index, dev->qset,
         dev->quantum, dev->size);
 
     for (d = dev->data; d; d = d->next) {
@@ -402,13 +1702,19 @@ static int scull_read_mem_proc_show(struct seq_file *m, void* v)
 {
     int i, j;
     int limit = m->size - 80;
+    struct scull_dev *d;
 
-    for (i = 0; i < scull_nr_devs && m->count <= limit; i++) {
-        struct scull_dev *d = &scull_devices[i];
+    mutex_lock(&scull_idr_lock);
+    idr_for_each_entry(&scull_idr, d, i) {
         struct scull_qset *qs = d->data;
+
+        if (m->count > limit)
+            break;
         /*Critical section*/
-        if (mutex_lock_interruptible(&d->mutex))
+        if (mutex_lock_interruptible(&d->mutex)) {
+            mutex_unlock(&scull_idr_lock);
             return -ERESTARTSYS;
+        }
         seq_printf(m, "\nDevice %i: qset %i, q %i, sz %li\n",
                 i, d->qset, d->quantum, d->size);
         for (; qs && m->count <= limit; qs = qs->next) {
@@ -421,9 +1727,10 @@ static int scull_read_mem_proc_show(struct seq_file *m, void* v)
                                 j, qs->data[j]);
                 }
         }
-        mutex_unlock(&scull_devices[i].mutex);
+        mutex_unlock(&d->mutex);
         /*End of Critical section*/
     }
+    mutex_unlock(&scull_idr_lock);
     return 0;
 }
 
@@ -440,13 +1747,27 @@ static int scull_proc_open(struct inode* inode, struct file* file)
 }
 
 
-static struct file_operations scull_proc_ops = {
-    .owner = THIS_MODULE,
-    .open = scull_proc_open,
-    .read = seq_read,
-    .llseek = seq_lseek,
-    .release = seq_release,
-};
+/* proc entries take a struct proc_ops since 5.6 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define SCULL_PROC_OPS(_name, _open, _release) \
+    static const struct proc_ops _name = { \
+        .proc_open = _open, \
+        .proc_read = seq_read, \
+        .proc_lseek = seq_lseek, \
+        .proc_release = _release, \
+    }
+#else
+#define SCULL_PROC_OPS(_name, _open, _release) \
+    static const struct file_operations _name = { \
+        .owner = THIS_MODULE, \
+        .open = _open, \
+        .read = seq_read, \
+        .llseek = seq_lseek, \
+        .release = _release, \
+    }
+#endif
+
+SCULL_PROC_OPS(scull_proc_ops, scull_proc_open, seq_release);
 
 
 #define DEFINE_PROC_SEQ_FILE(_name) \
@@ -455,12 +1776,7 @@ static struct file_operations scull_proc_ops = {
     {\
         return single_open(file, _name##_proc_show, NULL); \
     } \
-    static const struct file_operations _name##_proc_fops = { \
-        .open = _name##_proc_open, \
-        .read = seq_read, \
-        .llseek = seq_lseek, \
-        .release = single_release, \
-    };
+    SCULL_PROC_OPS(_name##_proc_fops, _name##_proc_open, single_release);
 
 DEFINE_PROC_SEQ_FILE(scull_read_mem)
 
@@ -483,22 +1799,28 @@ static void scull_remove_proc(void)
 
 inline void scull_cleanup(void)
 {
+    struct scull_dev *dev;
     int i;
     dev_t devno = MKDEV(scull_major, scull_minor);
 
-    if (scull_devices) {
-        for (i = 0; i < scull_nr_devs; i++) {
-            scull_trim(scull_devices + i);
-            cdev_del(&scull_devices[i].cdev);
-            device_destroy(scull_class, MKDEV(scull_major, i));
-        }
-        kfree(scull_devices);
+    /* queued requests still point at their devices */
+    if (scull_aio_wq)
+        destroy_workqueue(scull_aio_wq);
+
+    idr_for_each_entry(&scull_idr, dev, i)
+        scull_destroy_dev(i);
+    idr_destroy(&scull_idr);
+
+    if (scull_ctl_cdev.ops) {
+        device_destroy(scull_class,
+                MKDEV(scull_major, scull_minor + SCULL_MAX_DEVS));
+        cdev_del(&scull_ctl_cdev);
     }
 
     if (scull_class)
         class_destroy(scull_class);
 
-    unregister_chrdev_region(devno, scull_nr_devs);
+    unregister_chrdev_region(devno, SCULL_MAX_DEVS + 1);
 #ifdef SCULL_DEBUG
     scull_remove_proc();
 #endif
@@ -509,39 +1831,50 @@ static void __exit scull_exit(void)
     scull_cleanup();
 }
 
-static void scull_setup_cdev(struct scull_dev* dev, int index)
+/*
+ * The control node takes the minor after the last device and creates or
+ * destroys devices at runtime through SCULL_IOCCREATE/SCULL_IOCDESTROY.
+ */
+static int scull_setup_ctl(void)
 {
-    int err, devno = MKDEV(scull_major,scull_minor + index);
-    cdev_init(&dev->cdev, &scull_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &scull_fops;
-    err = cdev_add(&dev->cdev, devno, 1);
+    int err, devno = MKDEV(scull_major, scull_minor + SCULL_MAX_DEVS);
+    struct device *device;
+
+    cdev_init(&scull_ctl_cdev, &scull_ctl_fops);
+    scull_ctl_cdev.owner = THIS_MODULE;
+    err = cdev_add(&scull_ctl_cdev, devno, 1);
+    if (err) {
+        scull_ctl_cdev.ops = NULL;
+        return err;
+    }
 
-    device_create(scull_class,
-            NULL,
-            MKDEV(scull_major, index),
-            NULL,
-            "scull%d", index);
+    device = device_create(scull_class, NULL, devno, NULL,
+            SCULL_NAME "-control");
+    if (IS_ERR(device)) {
+        cdev_del(&scull_ctl_cdev);
+        scull_ctl_cdev.ops = NULL;
+        return PTR_ERR(device);
+    }
 
-    if (err)
-        printk(KERN_NOTICE "Error %d: adding scull %d\n", err,
-                index);
+    return 0;
 }
 
 static int __init scull_init(void)
 {
     int result, i;
     dev_t dev = 0;
+    struct scull_dev *sdev;
+    struct scull_geometry geo = { 0 };
 
     PDEBUG("%s\n", __func__);
 
     if (scull_major) {
         dev = MKDEV(scull_major, scull_minor);
-        result = register_chrdev_region(dev, scull_nr_devs,
+        result = register_chrdev_region(dev, SCULL_MAX_DEVS + 1,
                 SCULL_NAME);
     } else {
-        result = alloc_chrdev_region(&dev, scull_major, scull_nr_devs,
-                SCULL_NAME);
+        result = alloc_chrdev_region(&dev, scull_minor,
+                SCULL_MAX_DEVS + 1, SCULL_NAME);
         scull_major = MAJOR(dev);
     }
 
@@ -551,18 +1884,13 @@ static int __init scull_init(void)
         return result;
     }
 
-    scull_devices = kmalloc(scull_nr_devs * sizeof(struct scull_dev),
-            GFP_KERNEL);
-    if (!scull_devices) {
-        printk(KERN_INFO "scull: kammloc faild \n");
+    scull_aio_wq = alloc_workqueue("scull_aio", WQ_UNBOUND, 0);
+    if (!scull_aio_wq) {
         result = -ENOMEM;
         goto fail;
     }
 
-    memset(scull_devices, 0,
-            scull_nr_devs * sizeof(struct scull_dev));
-
-    scull_class = class_create(THIS_MODULE, SCULL_NAME);
+    scull_class = scull_class_create(SCULL_NAME);
 
     if (IS_ERR(scull_class)) {
         result = -EFAULT;
@@ -570,11 +1898,19 @@ static int __init scull_init(void)
         goto fail;
     }
 
+    result = scull_setup_ctl();
+    if (result) {
+        printk(KERN_WARNING "%s: error creating control node\n",
+                SCULL_NAME);
+        goto fail;
+    }
+
     for (i = 0; i < scull_nr_devs; i++) {
-        scull_devices[i].quantum = scull_quantum;
-        scull_devices[i].qset = scull_qset;
-        mutex_init(&scull_devices[i].mutex);
-        scull_setup_cdev(&scull_devices[i], i);
+        sdev = scull_create_dev(&geo, NULL);
+        if (IS_ERR(sdev)) {
+            result = PTR_ERR(sdev);
+            goto fail;
+        }
     }
 
 #ifdef SCULL_DEBUG
@@ -9,6 +9,11 @@
 #define SCULL_NR_DEVS 4
 #endif /* SCULL_NR_DEVS */
 
+/* upper bound of devices alive at once, including runtime-created ones */
+#ifndef SCULL_MAX_DEVS
+#define SCULL_MAX_DEVS 1024
+#endif /* SCULL_MAX_DEVS */
+
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
 #endif /* SCULL_QUANTUM */
@@ -17,6 +22,39 @@
 #define SCULL_QSET 1000
 #endif
 
+/* default log2 of the key index buckets of SCULL_DEV_KV devices */
+#ifndef SCULL_KV_BITS
+#define SCULL_KV_BITS 16
+#endif
+
+#define SCULL_KV_MAX_BITS 24
+#define SCULL_KV_MAX_KEY 255
+#define SCULL_KV_MAX_BATCH 1024
+
+/* dead value bytes before a PUT may compact, and then only if most are */
+#ifndef SCULL_KV_COMPACT_MIN
+#define SCULL_KV_COMPACT_MIN (1024 * 1024)
+#endif
+
+/*
+ * Requests of at least SCULL_DIO_THRESHOLD bytes pin the user buffer,
+ * SCULL_DIO_PIN_PAGES pages at a time outside the device lock, and copy it
+ * page by page, SCULL_DIO_CHUNK_PAGES pages per lock hold.
+ */
+#ifndef SCULL_DIO_THRESHOLD
+#define SCULL_DIO_THRESHOLD (256 * 1024)
+#endif
+
+#ifndef SCULL_DIO_CHUNK_PAGES
+#define SCULL_DIO_CHUNK_PAGES 256
+#endif
+
+#ifndef SCULL_DIO_PIN_PAGES
+#define SCULL_DIO_PIN_PAGES 4096
+#endif
+
+/* the kernel side; user space (the benchmarks) only needs the ioctls */
+#ifdef __KERNEL__
 struct scull_qset {
     void** data;
     struct scull_qset* next;
@@ -26,10 +64,21 @@ struct scull_dev {
     struct scull_qset* data;
     int quantum;
     int qset;
+    int def_quantum;    /* restored by trim, 0 for the module default */
+    int def_qset;
+    int index;
+    unsigned int flags;         /* SCULL_DEV_* */
+    unsigned int kv_bits;
+    struct hlist_head* kv_table;    /* SCULL_DEV_KV key index */
+    unsigned long kv_dead;          /* replaced or deleted value bytes */
+    atomic_long_t log_tail;         /* SCULL_DEV_LOG reserved bytes */
+    spinlock_t log_lock;            /* SCULL_DEV_LOG publication */
+    struct list_head log_pending;   /* finished records not yet published */
     unsigned long size;
     unsigned int access_key;
+    struct kref ref;
     struct mutex mutex;
-    struct cdev cdev;
+    struct cdev* cdev;
 };
 
 extern int scull_major;
@@ -37,7 +86,7 @@ extern int scull_nr_devs;
 extern int scull_qset;
 extern int scull_quantum;
 
-#define SCULL_DEBUG
+/* defined by make DEBUG=1 */
 #ifdef SCULL_DEBUG
     #define PDEBUG(fmt, args...) printk(KERN_INFO "scull: " fmt, ## args)
     #define DUMP_STACK() dump_stack()
@@ -45,6 +94,7 @@ extern int scull_quantum;
     #define PDEBUG(fmt, args...) ;
     #define DUMP_STACK() ;
 #endif /* SCULL_DEBUG */
+#endif /* __KERNEL__ */
 
 #include <linux/ioctl.h>
 
@@ -79,5 +129,62 @@ extern int scull_quantum;
 #define SCULL_IOCHQUANTUM _IO(SCULL_IOC_MAGIC, 11)
 #define SCULL_IOCHQSET _IO(SCULL_IOC_MAGIC, 12)
 
-#define SCULL_IOC_MAXNR 12
+/*
+ * Control node (/dev/scull-control) commands
+ */
+struct scull_geometry {
+    int index;      /* out: the new device is /dev/scull<index> */
+    int quantum;    /* 0 for the module default */
+    int qset;       /* 0 for the module default */
+    int flags;      /* SCULL_DEV_* */
+    int kv_bits;    /* log2 of the key index buckets, 0 for SCULL_KV_BITS */
+};
+
+/* keep a key -> value index, see SCULL_IOCKV* */
+#define SCULL_DEV_KV 0x1
+/* append-only log, every write lands atomically at the tail */
+#define SCULL_DEV_LOG 0x2
+
+#define SCULL_IOCCREATE   _IOWR(SCULL_IOC_MAGIC, 13, struct scull_geometry)
+#define SCULL_IOCDESTROY  _IO(SCULL_IOC_MAGIC, 14)
+
+/*
+ * Key-value commands, SCULL_DEV_KV devices only. PUT appends the value to
+ * the device; the space of replaced and deleted values is reclaimed by a
+ * later PUT that compacts the device. KV devices can be read but not
+ * written, and are not trimmed on open.
+ */
+struct scull_kv {
+    const void* key;
+    unsigned int key_len;   /* 1..SCULL_KV_MAX_KEY */
+    void* val;
+    unsigned int val_len;   /* buffer size, GET sets the value size */
+    int result;             /* MGET: 0 or -errno of this entry */
+};
+
+struct scull_kv_batch {
+    struct scull_kv* ops;
+    unsigned int nr;        /* at most SCULL_KV_MAX_BATCH */
+};
+
+#define SCULL_IOCKVPUT    _IOW(SCULL_IOC_MAGIC, 15, struct scull_kv)
+#define SCULL_IOCKVGET    _IOWR(SCULL_IOC_MAGIC, 16, struct scull_kv)
+#define SCULL_IOCKVDEL    _IOW(SCULL_IOC_MAGIC, 17, struct scull_kv)
+#define SCULL_IOCKVMGET   _IOW(SCULL_IOC_MAGIC, 18, struct scull_kv_batch)
+
+/*
+ * Log append, SCULL_DEV_LOG devices only. A record whose buffer faults
+ * halfway is still appended, but zero-filled: result is then -EFAULT and
+ * offset locates the voided record. write() reports it as -EFAULT only.
+ */
+struct scull_log_rec {
+    const void* buf;
+    unsigned int len;
+    long long offset;       /* out: where the record was written */
+    int result;             /* out: 0 or -EFAULT if the record is void */
+};
+
+#define SCULL_IOCLOGAPPEND _IOWR(SCULL_IOC_MAGIC, 19, struct scull_log_rec)
+
+#define SCULL_IOC_MAXNR 19
 #endif /*SCULL_H*/